@@ -47,6 +47,7 @@
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
+#include <clock.h>
 #include <synch.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
@@ -159,6 +160,69 @@ translate_err(struct emu_softc *sc, uint32_t code)
 	return EAGAIN;
 }
 
+/*
+ * Microseconds from SECS/NSECS to now.
+ */
+static
+uint32_t
+emu_since(time_t secs, uint32_t nsecs)
+{
+	time_t now, dsecs;
+	uint32_t nownsecs, dnsecs;
+
+	gettime(&now, &nownsecs);
+	getinterval(secs, nsecs, now, nownsecs, &dsecs, &dnsecs);
+	return dsecs*1000000 + dnsecs/1000;
+}
+
+/*
+ * Take the device for an operation, counting how long we waited for
+ * it. Returns the time we got it in SECS/NSECS, for emu_count and
+ * emu_unlock.
+ */
+static
+void
+emu_lock(struct emu_softc *sc, time_t *secs, uint32_t *nsecs)
+{
+	time_t wsecs;
+	uint32_t wnsecs;
+
+	gettime(&wsecs, &wnsecs);
+	lock_acquire(sc->e_lock);
+	gettime(secs, nsecs);
+
+	sc->e_nlocks++;
+	sc->e_waitus += emu_since(wsecs, wnsecs);
+}
+
+/*
+ * Count an operation of kind OP, started at SECS/NSECS, that moved
+ * BYTES bytes.
+ */
+static
+void
+emu_count(struct emu_softc *sc, uint32_t op, uint32_t bytes,
+	  time_t secs, uint32_t nsecs)
+{
+	KASSERT(lock_do_i_hold(sc->e_lock));
+	KASSERT(op < EMU_NOPS);
+
+	sc->e_stats[op].es_ops++;
+	sc->e_stats[op].es_bytes += bytes;
+	sc->e_stats[op].es_usec += emu_since(secs, nsecs);
+}
+
+/*
+ * Give the device back, after taking it with emu_lock.
+ */
+static
+void
+emu_unlock(struct emu_softc *sc, time_t secs, uint32_t nsecs)
+{
+	sc->e_holdus += emu_since(secs, nsecs);
+	lock_release(sc->e_lock);
+}
+
 /*
  * Wait for an operation to complete, and return an errno for the result.
  */
@@ -183,6 +247,8 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	 uint32_t *newhandle, int *newisdir)
 {
 	uint32_t op;
+	time_t secs;
+	uint32_t nsecs;
 	int result;
 
 	if (strlen(name)+1 > EMU_MAXIO) {
@@ -202,7 +268,7 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	/* mode isn't supported (yet?) */
 	(void)mode;
 
-	lock_acquire(sc->e_lock);
+	emu_lock(sc, &secs, &nsecs);
 
 	strcpy(sc->e_iobuf, name);
 	emu_wreg(sc, REG_IOLEN, strlen(name));
@@ -215,7 +281,8 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 		*newisdir = emu_rreg(sc, REG_IOLEN)>0;
 	}
 
-	lock_release(sc->e_lock);
+	emu_count(sc, op, 0, secs, nsecs);
+	emu_unlock(sc, secs, nsecs);
 	return result;
 }
 
@@ -231,10 +298,15 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	int result;
 	bool mine;
 	int retries = 0;
+	time_t secs;
+	uint32_t nsecs;
 
 	mine = lock_do_i_hold(sc->e_lock);
 	if (!mine) {
-		lock_acquire(sc->e_lock);
+		emu_lock(sc, &secs, &nsecs);
+	}
+	else {
+		gettime(&secs, &nsecs);
 	}
 
 	while (1) {
@@ -253,25 +325,35 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 		break;
 	}
 
+	emu_count(sc, EMU_OP_CLOSE, 0, secs, nsecs);
 	if (!mine) {
-		lock_release(sc->e_lock);
+		emu_unlock(sc, secs, nsecs);
 	}
 	return result;
 }
 
 /*
- * Common code for read and readdir.
+ * Common code for read and readdir: one operation of up to LEN (at
+ * most EMU_MAXIO) bytes.
+ *
+ * The data goes from the device's buffer to the uio with e_lock held,
+ * so it had better not be slow to get to. File data always goes to
+ * the page cache (in kernel memory); only directory entries, which
+ * are small, go straight to user memory.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	time_t secs;
+	uint32_t nsecs, got = 0;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_MAXIO);
 
-	lock_acquire(sc->e_lock);
+	emu_lock(sc, &secs, &nsecs);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
@@ -282,24 +364,51 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		goto out;
 	}
 	
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	got = emu_rreg(sc, REG_IOLEN);
+	result = uiomove(sc->e_iobuf, got, uio);
 
 	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
 
  out:
-	lock_release(sc->e_lock);
+	emu_count(sc, op, got, secs, nsecs);
+	emu_unlock(sc, secs, nsecs);
 	return result;
 }
 
 /*
- * Read from a hardware-level file handle.
+ * Read from a hardware-level file handle: all of UIO, unless EOF
+ * comes first. This is done in chunks of up to EMU_MAXIO bytes, each
+ * a separate operation, so other threads' operations can go in
+ * between.
  */
 static
 int
-emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
+emu_read(struct emu_softc *sc, uint32_t handle, struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
+	uint32_t amt;
+	size_t oldresid;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		amt = uio->uio_resid;
+		if (amt > EMU_MAXIO) {
+			amt = EMU_MAXIO;
+		}
+
+		oldresid = uio->uio_resid;
+
+		result = emu_doread(sc, handle, amt, EMU_OP_READ, uio);
+		if (result) {
+			return result;
+		}
+
+		if (uio->uio_resid == oldresid) {
+			/* nothing read - EOF */
+			break;
+		}
+	}
+
+	return 0;
 }
 
 /*
@@ -314,18 +423,23 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write one operation's worth (LEN bytes, at most EMU_MAXIO) to a
+ * hardware-level file handle. As with emu_doread, UIO should be in
+ * kernel memory.
  */
 static
 int
-emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	  struct uio *uio)
+emu_dowrite(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	    struct uio *uio)
 {
+	time_t secs;
+	uint32_t nsecs;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(len <= EMU_MAXIO);
 
-	lock_acquire(sc->e_lock);
+	emu_lock(sc, &secs, &nsecs);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
@@ -340,10 +454,37 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	result = emu_waitdone(sc);
 
  out:
-	lock_release(sc->e_lock);
+	emu_count(sc, EMU_OP_WRITE, result ? 0 : len, secs, nsecs);
+	emu_unlock(sc, secs, nsecs);
 	return result;
 }
 
+/*
+ * Write all of UIO to a hardware-level file handle, in chunks of up
+ * to EMU_MAXIO bytes, like emu_read.
+ */
+static
+int
+emu_write(struct emu_softc *sc, uint32_t handle, struct uio *uio)
+{
+	uint32_t amt;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		amt = uio->uio_resid;
+		if (amt > EMU_MAXIO) {
+			amt = EMU_MAXIO;
+		}
+
+		result = emu_dowrite(sc, handle, amt, uio);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Get the file size associated with a hardware-level file handle.
  */
@@ -351,9 +492,11 @@ static
 int
 emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 {
+	time_t secs;
+	uint32_t nsecs;
 	int result;
 
-	lock_acquire(sc->e_lock);
+	emu_lock(sc, &secs, &nsecs);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, EMU_OP_GETSIZE);
@@ -362,7 +505,8 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 		*retval = emu_rreg(sc, REG_IOLEN);
 	}
 
-	lock_release(sc->e_lock);
+	emu_count(sc, EMU_OP_GETSIZE, 0, secs, nsecs);
+	emu_unlock(sc, secs, nsecs);
 	return result;
 }
 
@@ -373,19 +517,507 @@ static
 int
 emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 {
+	time_t secs;
+	uint32_t nsecs;
 	int result;
 
-	lock_acquire(sc->e_lock);
+	emu_lock(sc, &secs, &nsecs);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OPER, EMU_OP_TRUNC);
 	result = emu_waitdone(sc);
 
-	lock_release(sc->e_lock);
+	emu_count(sc, EMU_OP_TRUNC, 0, secs, nsecs);
+	emu_unlock(sc, secs, nsecs);
+	return result;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Page cache
+//
+// File data is cached in pages of EMUFS_PAGESIZE bytes, so that
+// things read over and over (like the binaries for exec) come from
+// memory instead of the host, and small writes are collected into
+// page-sized ones. Dirty pages are written back when they're reused,
+// on fsync, on reclaim, and by FSOP_SYNC (which the VFS syncer calls
+// every few seconds). Each file's size is also cached, after asking
+// the host the first time, and kept up to date by our own writes and
+// truncates.
+//
+// This assumes that nothing on the host side changes files while
+// we're using them; if something does, we may see old data.
+//
+// The pages are on an LRU list, most recently used first; unused
+// ones are at the tail. The bytes of a page past ep_len are always
+// zero, so holes and extensions of the file read as zeros. Only the
+// first ep_len bytes are written back.
+//
+// Consecutive pages are read in, and written back, together, up to
+// EMU_MAXIO bytes at a time, so big transfers take few operations.
+//
+// Each file's ev_lock is held for the whole of each read, write and
+// truncate of it, so these don't mix, and it protects the file's
+// size. The cache itself is protected by ef_cachelock. That isn't
+// held while pages are moved to or from the host; the pages being
+// moved are marked busy instead, and anyone who wants one of them
+// waits on ef_cachecv. So while one file's big transfer goes on,
+// chunk by chunk, other files' reads and writes use the cache, and
+// their own host operations run between the chunks.
+//
+// Only the holder of a file's ev_lock brings that file's pages into
+// the cache. Other threads may only write them back and reuse them.
+//
+// The lock order is ev_lock, ef_cachelock, vfs_biglock, e_lock.
+//
+
+/* Most pages moved in one operation */
+#define EMUFS_CLUSTER (EMU_MAXIO / EMUFS_PAGESIZE)
+
+/* All emufs instances, for emufs_printstats */
+static struct emufs_fs *emufs_list;
+
+static
+void
+emufs_lru_remove(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	if (ep->ep_lruprev != NULL) {
+		ep->ep_lruprev->ep_lrunext = ep->ep_lrunext;
+	}
+	else {
+		ef->ef_lruhead = ep->ep_lrunext;
+	}
+	if (ep->ep_lrunext != NULL) {
+		ep->ep_lrunext->ep_lruprev = ep->ep_lruprev;
+	}
+	else {
+		ef->ef_lrutail = ep->ep_lruprev;
+	}
+}
+
+static
+void
+emufs_lru_addhead(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	ep->ep_lruprev = NULL;
+	ep->ep_lrunext = ef->ef_lruhead;
+	if (ef->ef_lruhead != NULL) {
+		ef->ef_lruhead->ep_lruprev = ep;
+	}
+	else {
+		ef->ef_lrutail = ep;
+	}
+	ef->ef_lruhead = ep;
+}
+
+static
+void
+emufs_lru_addtail(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	ep->ep_lrunext = NULL;
+	ep->ep_lruprev = ef->ef_lrutail;
+	if (ef->ef_lrutail != NULL) {
+		ef->ef_lrutail->ep_lrunext = ep;
+	}
+	else {
+		ef->ef_lruhead = ep;
+	}
+	ef->ef_lrutail = ep;
+}
+
+/*
+ * Set up the page cache for a new fs.
+ */
+static
+int
+emufs_cache_init(struct emufs_fs *ef)
+{
+	unsigned i;
+
+	ef->ef_cachelock = lock_create("emufs-cache");
+	if (ef->ef_cachelock == NULL) {
+		return ENOMEM;
+	}
+	ef->ef_cachecv = cv_create("emufs-cache");
+	if (ef->ef_cachecv == NULL) {
+		lock_destroy(ef->ef_cachelock);
+		return ENOMEM;
+	}
+
+	ef->ef_lruhead = ef->ef_lrutail = NULL;
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ef->ef_pages[i].ep_vn = NULL;
+		ef->ef_pages[i].ep_dirty = false;
+		ef->ef_pages[i].ep_busy = false;
+		ef->ef_pages[i].ep_data = NULL;
+		emufs_lru_addtail(ef, &ef->ef_pages[i]);
+	}
+	return 0;
+}
+
+/*
+ * Get the size of EV's file.
+ */
+static
+int
+emufs_getsize(struct emufs_vnode *ev, off_t *ret)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (!ev->ev_sizevalid) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+		if (result) {
+			return result;
+		}
+		ev->ev_sizevalid = true;
+	}
+	*ret = ev->ev_size;
+	return 0;
+}
+
+/*
+ * Forget a page, discarding any changes.
+ */
+static
+void
+emufs_page_drop(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	KASSERT(!ep->ep_busy);
+
+	ep->ep_vn = NULL;
+	ep->ep_dirty = false;
+	emufs_lru_remove(ef, ep);
+	emufs_lru_addtail(ef, ep);
+}
+
+/*
+ * Find page PAGENO of EV's file, if it's cached.
+ */
+static
+struct emufs_page *
+emufs_findpage(struct emufs_fs *ef, struct emufs_vnode *ev, uint32_t pageno)
+{
+	unsigned i;
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_vn == ev &&
+		    ef->ef_pages[i].ep_pageno == pageno) {
+			return &ef->ef_pages[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Set up a uio for transferring the pages RUN[0..N-1], which are
+ * consecutive pages of one file, with one LEN-byte transfer.
+ */
+static
+void
+emufs_run_uio(struct emufs_page **run, unsigned n, uint32_t len,
+	      enum uio_rw rw, struct iovec *iov, struct uio *ku)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = run[i]->ep_data;
+		iov[i].iov_len = rw == UIO_WRITE ?
+			run[i]->ep_len : EMUFS_PAGESIZE;
+	}
+	ku->uio_iov = iov;
+	ku->uio_iovcnt = n;
+	ku->uio_offset = (off_t)run[0]->ep_pageno << EMUFS_PAGESHIFT;
+	ku->uio_resid = len;
+	ku->uio_segflg = UIO_SYSSPACE;
+	ku->uio_rw = rw;
+	ku->uio_space = NULL;
+}
+
+/*
+ * Write a dirty page back to the host, together with the dirty pages
+ * of the file that follow it, as long as they're contiguous, in one
+ * transfer of up to EMU_MAXIO bytes. The pages are busy during the
+ * transfer, and ef_cachelock is released.
+ */
+static
+int
+emufs_page_writeback(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	struct emufs_vnode *ev = ep->ep_vn;
+	struct emufs_page *run[EMUFS_CLUSTER], *next;
+	struct iovec iov[EMUFS_CLUSTER];
+	struct uio ku;
+	unsigned n, i;
+	uint32_t len;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(ep->ep_dirty && !ep->ep_busy);
+
+	run[0] = ep;
+	len = ep->ep_len;
+	n = 1;
+	while (n < EMUFS_CLUSTER && run[n-1]->ep_len == EMUFS_PAGESIZE) {
+		next = emufs_findpage(ef, ev, ep->ep_pageno + n);
+		if (next == NULL || !next->ep_dirty || next->ep_busy) {
+			break;
+		}
+		run[n++] = next;
+		len += next->ep_len;
+	}
+
+	for (i=0; i<n; i++) {
+		run[i]->ep_busy = true;
+	}
+	emufs_run_uio(run, n, len, UIO_WRITE, iov, &ku);
+	lock_release(ef->ef_cachelock);
+
+	result = emu_write(ev->ev_emu, ev->ev_handle, &ku);
+
+	lock_acquire(ef->ef_cachelock);
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			run[i]->ep_dirty = false;
+		}
+		run[i]->ep_busy = false;
+	}
+	cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
 	return result;
 }
 
+/*
+ * Read the pages RUN[0..N-1], which are consecutive pages of one
+ * file, in from the host in one transfer. SIZE is the file size;
+ * nothing past it is read. The pages must be busy; ef_cachelock is
+ * released during the transfer.
+ */
+static
+int
+emufs_page_fill(struct emufs_fs *ef, struct emufs_page **run, unsigned n,
+		off_t size)
+{
+	struct emufs_vnode *ev = run[0]->ep_vn;
+	struct iovec iov[EMUFS_CLUSTER];
+	struct uio ku;
+	off_t start;
+	uint32_t len, got, plen;
+	unsigned i;
+	int result;
+
+	KASSERT(n <= EMUFS_CLUSTER);
+
+	start = (off_t)run[0]->ep_pageno << EMUFS_PAGESHIFT;
+	len = 0;
+	if (start < size) {
+		len = size - start > n * EMUFS_PAGESIZE ?
+			n * EMUFS_PAGESIZE : size - start;
+	}
+
+	emufs_run_uio(run, n, len, UIO_READ, iov, &ku);
+	lock_release(ef->ef_cachelock);
+	result = emu_read(ev->ev_emu, ev->ev_handle, &ku);
+	lock_acquire(ef->ef_cachelock);
+	if (result) {
+		return result;
+	}
+
+	got = len - ku.uio_resid;
+	for (i=0; i<n; i++) {
+		plen = 0;
+		if (got > i * EMUFS_PAGESIZE) {
+			plen = got - i * EMUFS_PAGESIZE;
+			if (plen > EMUFS_PAGESIZE) {
+				plen = EMUFS_PAGESIZE;
+			}
+		}
+		run[i]->ep_len = plen;
+		bzero(run[i]->ep_data + plen, EMUFS_PAGESIZE - plen);
+	}
+	return 0;
+}
+
+/*
+ * Take the least recently used page that isn't busy for reuse,
+ * writing it back first if need be, and make it the most recently
+ * used. If every page is busy, wait for one unless WAIT is false, in
+ * which case fail with EAGAIN. Don't wait while holding busy pages:
+ * their owner might be waiting too.
+ */
+static
+int
+emufs_page_take(struct emufs_fs *ef, bool wait, struct emufs_page **ret)
+{
+	struct emufs_page *ep;
+	int result;
+
+ retry:
+	for (ep = ef->ef_lrutail; ep != NULL; ep = ep->ep_lruprev) {
+		if (!ep->ep_busy) {
+			break;
+		}
+	}
+	if (ep == NULL) {
+		if (!wait) {
+			return EAGAIN;
+		}
+		cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+		goto retry;
+	}
+	if (ep->ep_vn != NULL && ep->ep_dirty) {
+		/* This drops the lock, so look again afterwards */
+		result = emufs_page_writeback(ef, ep);
+		if (result) {
+			return result;
+		}
+		goto retry;
+	}
+	if (ep->ep_data == NULL) {
+		ep->ep_data = kmalloc(EMUFS_PAGESIZE);
+		if (ep->ep_data == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	ep->ep_vn = NULL;
+	ep->ep_dirty = false;
+	ep->ep_len = 0;
+	emufs_lru_remove(ef, ep);
+	emufs_lru_addhead(ef, ep);
+	*ret = ep;
+	return 0;
+}
+
+/*
+ * Get page PAGENO of EV's file. SIZE is the file size.
+ *
+ * If the page isn't cached, it's read in, unless FILL is false (when
+ * the caller is going to overwrite all of the file's data in it).
+ * When reading, up to NPAGES pages (as many as the caller is going to
+ * want) are read at once, as long as they exist and aren't cached
+ * already.
+ *
+ * The caller must hold EV's ev_lock, so none of EV's pages can turn up
+ * in the cache while ef_cachelock is released.
+ */
+static
+int
+emufs_getpage(struct emufs_fs *ef, struct emufs_vnode *ev, uint32_t pageno,
+	      off_t size, bool fill, unsigned npages, struct emufs_page **ret)
+{
+	struct emufs_page *run[EMUFS_CLUSTER], *ep;
+	unsigned n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+ retry:
+	ep = emufs_findpage(ef, ev, pageno);
+	if (ep != NULL) {
+		if (ep->ep_busy) {
+			/* being written back; it may be gone afterwards */
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+			goto retry;
+		}
+		ef->ef_hits++;
+		emufs_lru_remove(ef, ep);
+		emufs_lru_addhead(ef, ep);
+		*ret = ep;
+		return 0;
+	}
+	ef->ef_misses++;
+
+	n = 0;
+	do {
+		result = emufs_page_take(ef, n == 0, &run[n]);
+		if (result) {
+			if (n > 0) {
+				/* Make do with what we have */
+				break;
+			}
+			return result;
+		}
+		run[n]->ep_vn = ev;
+		run[n]->ep_pageno = pageno + n;
+		run[n]->ep_busy = true;
+		n++;
+	} while (fill && n < npages && n < EMUFS_CLUSTER &&
+		 ((off_t)(pageno + n) << EMUFS_PAGESHIFT) < size &&
+		 emufs_findpage(ef, ev, pageno + n) == NULL);
+
+	if (fill) {
+		result = emufs_page_fill(ef, run, n, size);
+	}
+	else {
+		bzero(run[0]->ep_data, EMUFS_PAGESIZE);
+		result = 0;
+	}
+	for (i=0; i<n; i++) {
+		run[i]->ep_busy = false;
+		if (result) {
+			emufs_page_drop(ef, run[i]);
+		}
+	}
+	cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
+	if (result) {
+		return result;
+	}
+
+	/* The one asked for is the most recently used */
+	ep = run[0];
+	emufs_lru_remove(ef, ep);
+	emufs_lru_addhead(ef, ep);
+	*ret = ep;
+	return 0;
+}
+
+/*
+ * Write back the dirty pages of EV's file, or of all files if EV is
+ * NULL. Waits for any of the pages that are busy, so when this
+ * returns, none of them is.
+ */
+static
+int
+emufs_cache_flush(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	unsigned i;
+	struct emufs_page *ep;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+ retry:
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vn == NULL) {
+			continue;
+		}
+		if (ev != NULL && ep->ep_vn != ev) {
+			continue;
+		}
+		if (ep->ep_busy) {
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+			goto retry;
+		}
+		if (!ep->ep_dirty) {
+			continue;
+		}
+		/* This drops the lock, so start over afterwards */
+		result = emufs_page_writeback(ef, ep);
+		if (result) {
+			return result;
+		}
+		goto retry;
+	}
+	return 0;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -471,6 +1103,18 @@ emufs_reclaim(struct vnode *v)
 	unsigned ix, i, num;
 	int result;
 
+	/*
+	 * Write back the file's cached data first. Holding the cache
+	 * lock keeps anyone from dirtying more of it until we're done,
+	 * and after the flush none of its pages is busy.
+	 */
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_cache_flush(ef, ev);
+	if (result) {
+		lock_release(ef->ef_cachelock);
+		return result;
+	}
+
 	/*
 	 * Need both of these locks, e_lock to protect the device
 	 * and vfs_biglock to protect the fs-related material.
@@ -479,20 +1123,39 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/*
+	 * Make sure nobody picked up the vnode since VOP_DECREF
+	 * decided to reclaim it; if so, consume that reference.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
+		lock_release(ef->ef_cachelock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
+		lock_release(ef->ef_cachelock);
 		return result;
 	}
 
+	/* The pages are all clean now; forget them */
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_vn == ev) {
+			KASSERT(!ef->ef_pages[i].ep_dirty);
+			emufs_page_drop(ef, &ef->ef_pages[i]);
+		}
+	}
+
 	num = vnodearray_num(ef->ef_vnodes);
 	ix = num;
 	for (i=0; i<num; i++) {
@@ -514,7 +1177,9 @@ emufs_reclaim(struct vnode *v)
 
 	lock_release(ef->ef_emu->e_lock);
 	vfs_biglock_release();
+	lock_release(ef->ef_cachelock);
 
+	lock_destroy(ev->ev_lock);
 	kfree(ev);
 	return 0;
 }
@@ -527,32 +1192,43 @@ int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *ep;
+	off_t size;
+	uint32_t pageoff, amt;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+	lock_acquire(ev->ev_lock);
+	result = emufs_getsize(ev, &size);
+	lock_acquire(ef->ef_cachelock);
+
+	while (result == 0 && uio->uio_resid > 0 && uio->uio_offset < size) {
+		pageoff = uio->uio_offset & (EMUFS_PAGESIZE - 1);
+		result = emufs_getpage(ef, ev,
+				       uio->uio_offset >> EMUFS_PAGESHIFT,
+				       size, true,
+				       (pageoff + uio->uio_resid +
+					EMUFS_PAGESIZE - 1) >> EMUFS_PAGESHIFT,
+				       &ep);
+		if (result) {
+			break;
 		}
 
-		oldresid = uio->uio_resid;
-
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		amt = EMUFS_PAGESIZE - pageoff;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
 		}
-		
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
-			break;
+		if (amt > size - uio->uio_offset) {
+			amt = size - uio->uio_offset;
 		}
+		result = uiomove(ep->ep_data + pageoff, amt, uio);
 	}
 
-	return 0;
+	lock_release(ef->ef_cachelock);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -583,32 +1259,59 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *ep;
+	off_t size, pagestart;
+	uint32_t pageoff, amt, existing, moved;
 	size_t oldresid;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
+	lock_acquire(ev->ev_lock);
+	result = emufs_getsize(ev, &size);
+	lock_acquire(ef->ef_cachelock);
 
-		oldresid = uio->uio_resid;
+	while (result == 0 && uio->uio_resid > 0) {
+		pageoff = uio->uio_offset & (EMUFS_PAGESIZE - 1);
+		pagestart = uio->uio_offset - pageoff;
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		amt = EMUFS_PAGESIZE - pageoff;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
 		}
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
+		/* Read the page in unless we're replacing all it has */
+		existing = 0;
+		if (pagestart < size) {
+			existing = size - pagestart > EMUFS_PAGESIZE ?
+				EMUFS_PAGESIZE : size - pagestart;
+		}
+		result = emufs_getpage(ef, ev,
+				       uio->uio_offset >> EMUFS_PAGESHIFT, size,
+				       existing > 0 &&
+				       (pageoff > 0 || amt < existing), 1, &ep);
+		if (result) {
 			break;
 		}
+
+		oldresid = uio->uio_resid;
+		result = uiomove(ep->ep_data + pageoff, amt, uio);
+		moved = oldresid - uio->uio_resid;
+		if (moved > 0) {
+			if (pageoff + moved > ep->ep_len) {
+				ep->ep_len = pageoff + moved;
+			}
+			ep->ep_dirty = true;
+		}
+		if (uio->uio_offset > size) {
+			size = ev->ev_size = uio->uio_offset;
+		}
 	}
 
-	return 0;
+	lock_release(ef->ef_cachelock);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -641,12 +1344,21 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
 	if (result) {
 		return result;
 	}
 
-	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	/* Only files' sizes are cached */
+	if (statbuf->st_mode == S_IFDIR) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle,
+				     &statbuf->st_size);
+	}
+	else {
+		lock_acquire(ev->ev_lock);
+		result = emufs_getsize(ev, &statbuf->st_size);
+		lock_release(ev->ev_lock);
+	}
 	if (result) {
 		return result;
 	}
@@ -705,8 +1417,14 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_cache_flush(ef, ev);
+	lock_release(ef->ef_cachelock);
+	return result;
 }
 
 /*
@@ -717,7 +1435,49 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *ep;
+	off_t start;
+	unsigned i;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	lock_acquire(ef->ef_cachelock);
+
+	/* Throw away cached data past the new end of the file */
+ retry:
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vn != ev) {
+			continue;
+		}
+		if (ep->ep_busy) {
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+			goto retry;
+		}
+		start = (off_t)ep->ep_pageno << EMUFS_PAGESHIFT;
+		if (start >= len) {
+			emufs_page_drop(ef, ep);
+		}
+		else if (start + ep->ep_len > len) {
+			bzero(ep->ep_data + (len - start),
+			      ep->ep_len - (len - start));
+			ep->ep_len = len - start;
+		}
+	}
+	lock_release(ef->ef_cachelock);
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result == 0) {
+		ev->ev_size = len;
+		ev->ev_sizevalid = true;
+	}
+	else {
+		ev->ev_sizevalid = false;
+	}
+
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -1182,12 +1942,23 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_size = 0;
+	ev->ev_sizevalid = false;
+
+	ev->ev_lock = lock_create("emufs-file");
+	if (ev->ev_lock == NULL) {
+		lock_release(ef->ef_emu->e_lock);
+		vfs_biglock_release();
+		kfree(ev);
+		return ENOMEM;
+	}
 
 	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			   &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
@@ -1198,6 +1969,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
@@ -1224,8 +1996,13 @@ static
 int
 emufs_sync(struct fs *fs)
 {
-	(void)fs;
-	return 0;
+	struct emufs_fs *ef = fs->fs_data;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_cache_flush(ef, NULL);
+	lock_release(ef->ef_cachelock);
+	return result;
 }
 
 /*
@@ -1299,12 +2076,20 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
+	ef->ef_hits = ef->ef_misses = 0;
 	ef->ef_vnodes = vnodearray_create();
 	if (ef->ef_vnodes == NULL) {
 		kfree(ef);
 		return ENOMEM;
 	}
 
+	result = emufs_cache_init(ef);
+	if (result) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return result;
+	}
+
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
 		kfree(ef);
@@ -1317,8 +2102,91 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	if (result) {
 		VOP_DECREF(&ef->ef_root->ev_v);
 		kfree(ef);
+		return result;
+	}
+
+	/* This happens only during boot, so no locking is needed */
+	ef->ef_next = emufs_list;
+	emufs_list = ef;
+	return 0;
+}
+
+/*
+ * Statistics.
+ */
+
+/* Names of the EMU_OP_* codes */
+static const char *const emu_opnames[EMU_NOPS] = {
+	NULL, "open", "create", "exclcreate", "close",
+	"read", "readdir", "write", "getsize", "trunc",
+};
+
+void
+emufs_printstats(void)
+{
+	struct emufs_fs *ef;
+	struct emu_softc *sc;
+	struct emu_opstats stats[EMU_NOPS];
+	unsigned nlocks, hits, misses, total, ninuse, ndirty, i;
+	uint32_t waitus, holdus, kb, ms;
+
+	if (emufs_list == NULL) {
+		kprintf("No emufs\n");
+		return;
+	}
+
+	for (ef = emufs_list; ef != NULL; ef = ef->ef_next) {
+		sc = ef->ef_emu;
+
+		lock_acquire(sc->e_lock);
+		memcpy(stats, sc->e_stats, sizeof(stats));
+		nlocks = sc->e_nlocks;
+		waitus = sc->e_waitus;
+		holdus = sc->e_holdus;
+		lock_release(sc->e_lock);
+
+		lock_acquire(ef->ef_cachelock);
+		hits = ef->ef_hits;
+		misses = ef->ef_misses;
+		ninuse = ndirty = 0;
+		for (i=0; i<EMUFS_NPAGES; i++) {
+			if (ef->ef_pages[i].ep_vn != NULL) {
+				ninuse++;
+			}
+			if (ef->ef_pages[i].ep_dirty) {
+				ndirty++;
+			}
+		}
+		lock_release(ef->ef_cachelock);
+
+		kprintf("emu%d: %u operations; avg usec per operation: "
+			"%u waiting for the device, %u using it\n",
+			sc->e_unit, nlocks,
+			nlocks == 0 ? 0 : waitus / nlocks,
+			nlocks == 0 ? 0 : holdus / nlocks);
+		for (i=1; i<EMU_NOPS; i++) {
+			if (stats[i].es_ops == 0) {
+				continue;
+			}
+			kprintf("    %-10s %u ops, avg %u usec", emu_opnames[i],
+				stats[i].es_ops,
+				stats[i].es_usec / stats[i].es_ops);
+			if (stats[i].es_bytes > 0) {
+				kb = stats[i].es_bytes / 1024;
+				ms = stats[i].es_usec / 1000;
+				kprintf(", %u KB", kb);
+				if (ms > 0) {
+					kprintf(", %u KB/s", kb * 1000 / ms);
+				}
+			}
+			kprintf("\n");
+		}
+		total = hits + misses;
+		kprintf("    page cache: %u of %u pages in use, %u dirty; "
+			"%u hits, %u misses (%u%% hit rate)\n",
+			ninuse, EMUFS_NPAGES, ndirty, hits, misses,
+			total == 0 ? 0 : (hits * 100) / total);
 	}
-	return result;
 }
 
 //
@@ -1346,6 +2214,11 @@ config_emu(struct emu_softc *sc, int emuno)
 	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
 
+	bzero(sc->e_stats, sizeof(sc->e_stats));
+	sc->e_nlocks = 0;
+	sc->e_waitus = 0;
+	sc->e_holdus = 0;
+
 	snprintf(name, sizeof(name), "emu%d", emuno);
 
 	return emufs_addtovfs(sc, name);
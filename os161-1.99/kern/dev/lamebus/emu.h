@@ -34,6 +34,18 @@
 #define EMU_MAXIO       16384
 #define EMU_ROOTHANDLE  0
 
+/* Operation codes run from 1 to EMU_NOPS-1 (see emu.c) */
+#define EMU_NOPS        10
+
+/*
+ * Statistics for one kind of operation.
+ */
+struct emu_opstats {
+	unsigned es_ops;		/* operations done */
+	uint32_t es_bytes;		/* bytes moved */
+	uint32_t es_usec;		/* total usec, from start to done */
+};
+
 /*
  * The per-device data used by the emufs device driver.
  * (Note that this is only a small portion of its actual data;
@@ -53,6 +65,12 @@ struct emu_softc {
 
 	/* Written by the interrupt handler */
 	uint32_t e_result;
+
+	/* Statistics, protected by e_lock */
+	struct emu_opstats e_stats[EMU_NOPS];
+	unsigned e_nlocks;		/* times e_lock was taken */
+	uint32_t e_waitus;		/* total usec waiting for e_lock */
+	uint32_t e_holdus;		/* total usec holding e_lock */
 };
 
 /* Functions called by lower-level drivers */
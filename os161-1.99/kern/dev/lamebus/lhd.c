@@ -29,13 +29,29 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The hardware does one sector at a time through a one-sector buffer
+ * on the card. Rather than have the requesting thread wake up and go
+ * back to sleep for every sector, callers put a request (a run of
+ * sectors and a kernel buffer) on the device's queue and sleep once;
+ * the interrupt handler moves each sector between the card and the
+ * buffer and starts the next sector, and the next request when one
+ * finishes, without waiting for any thread to run.
+ *
+ * Waiting requests are ordered by the I/O scheduler (iosched.c), which
+ * sorts them by sector in C-LOOK order; a request that continues
+ * where another leaves off thus goes to the disk right behind it, so
+ * adjacent requests from different threads make one unbroken run of
+ * sectors.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <iosched.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +75,25 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * Largest request for I/O that isn't to a single kernel buffer and
+ * has to be staged through one of our own.
+ */
+#define LHD_BOUNCESECTS 8
+
+/*
+ * A request: a run of sectors to transfer to or from DATA. Lives on
+ * the requesting thread's stack; the thread doesn't return until the
+ * interrupt handler has marked it finished.
+ */
+struct lhd_req {
+	struct ioreq lr_io;		/* sectors and direction; must be first */
+	uint32_t lr_done;		/* sectors transferred so far */
+	char *lr_data;			/* kernel buffer */
+	int lr_result;			/* error, once finished */
+	bool lr_finished;		/* set by interrupt handler */
+};
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,15 +130,96 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Hand the current sector of REQ to the hardware. Call with lh_lock
+ * held.
+ */
+static
+void
+lhd_issue(struct lhd_softc *lh, struct lhd_req *req)
+{
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(req->lr_done < req->lr_io.ir_nsect);
+
+	if (req->lr_io.ir_write) {
+		memcpy(lh->lh_buf, req->lr_data + req->lr_done*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_io.ir_sector + req->lr_done);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle and there's something queued, start it.
+ * Call with lh_lock held.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req *req;
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+	req = (struct lhd_req *)iosched_next(&lh->lh_sched);
+	if (req == NULL) {
+		return;
+	}
+	lh->lh_active = req;
+	lhd_issue(lh, req);
+}
+
+/*
+ * Record that a sector has completed: move the data if it was a
+ * read, and either start the request's next sector or finish the
+ * request, wake up whoever is waiting for it, and start the next
+ * request.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *req;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Not ours (spurious or left over from before boot) */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0) {
+		if (!req->lr_io.ir_write) {
+			memcpy(req->lr_data + req->lr_done*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->lr_done++;
+	}
+
+	if (err == 0 && req->lr_done < req->lr_io.ir_nsect) {
+		lhd_issue(lh, req);
+	}
+	else {
+		/* Once lr_finished is set, REQ may vanish; don't touch it */
+		uint32_t key = WCHAN_KEY(req->lr_io.ir_sector);
+
+		iosched_done(&lh->lh_sched, &req->lr_io);
+		req->lr_result = err;
+		req->lr_finished = true;
+		lh->lh_active = NULL;
+		wchan_wakeall_keyed(lh->lh_wchan, key);
+		lhd_start(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -193,8 +309,64 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request for NSECT sectors at SECTOR to or from DATA, and
+ * wait for it to finish.
+ */
+static
+int
+lhd_runreq(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	   bool write, char *data)
+{
+	struct lhd_req req;
+
+	req.lr_io.ir_sector = sector;
+	req.lr_io.ir_nsect = nsect;
+	req.lr_io.ir_write = write;
+	req.lr_done = 0;
+	req.lr_data = data;
+	req.lr_result = 0;
+	req.lr_finished = false;
+
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(&lh->lh_sched, &req.lr_io);
+	lhd_start(lh);
+	while (!req.lr_finished) {
+		/* Same handoff as in P(): take the wchan lock first */
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep_keyed(lh->lh_wchan, WCHAN_KEY(sector));
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return req.lr_result;
+}
+
+/*
+ * Account for LEN bytes transferred directly to or from the (single,
+ * kernel) buffer of UIO, as uiomove would have.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov = uio->uio_iov;
+
+	KASSERT(uio->uio_iovcnt == 1 && iov->iov_len >= len);
+	iov->iov_kbase = (char *)iov->iov_kbase + len;
+	iov->iov_len -= len;
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * If the uio is a single kernel buffer (as from the buffer cache),
+ * the whole transfer is one request straight to or from that buffer.
+ * Otherwise, it goes through a bounce buffer LHD_BOUNCESECTS sectors
+ * at a time, since the interrupt handler can't get at user memory.
  */
 static
 int
@@ -206,9 +378,13 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	bool write = (uio->uio_rw == UIO_WRITE);
+	bool direct;
+	char *bounce = NULL;
+	char *data;
+	uint32_t n;
+	size_t bytes;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -220,59 +396,57 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	direct = (uio->uio_segflg == UIO_SYSSPACE &&
+		  uio->uio_iovcnt == 1 &&
+		  uio->uio_iov->iov_len == uio->uio_resid);
+	if (!direct && len > 0) {
+		bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	while (len > 0) {
+		if (direct) {
+			n = len;
+			data = uio->uio_iov->iov_kbase;
+		}
+		else {
+			n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+			data = bounce;
+		}
+		bytes = n * LHD_SECTSIZE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (write && !direct) {
+			result = uiomove(bounce, bytes, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_runreq(lh, sector, n, write, data);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (direct) {
+			lhd_uioskip(uio, bytes);
+		}
+		else if (!write) {
+			result = uiomove(bounce, bytes, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
+	return result;
 }
 
 /*
@@ -289,17 +463,15 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_active = NULL;
+	iosched_init(&lh->lh_sched, name);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
@@ -30,13 +30,17 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <iosched.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+struct lhd_req;	/* private to lhd.c */
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +55,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* Requesters wait here */
+	struct lhd_req *lh_active;	/* Request the disk is working on */
+	struct iosched lh_sched;	/* Requests waiting to start */
 
 	struct device lh_dev;		/* VFS device structure */
 };
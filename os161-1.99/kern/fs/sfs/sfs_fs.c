@@ -39,27 +39,32 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+#define SFS_FS_BITMAPSIZE(sfs) \
+	SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_BITBLOCKS(sfs) \
+	SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading (at mount time) does the whole bitmap; writing does only
+ * the blocks marked in sfs_freemapdirty, and unmarks them.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
- * that the bitmap will (in general) contain space for some number of
- * invalid sectors that are actually beyond the end of the disk
- * device. This is ok. These sectors are supposed to be marked "in
- * use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_BITBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the bits
+ * in a block (4096 with 512-byte blocks). (This rounded number is
+ * SFS_BITMAPSIZE.) This means that the bitmap will (in general)
+ * contain space for some number of invalid blocks that are actually
+ * beyond the end of the disk device. This is ok. These blocks are
+ * supposed to be marked "in use" by mksfs and never get marked
+ * "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -82,25 +87,53 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
 
+		/* When writing, skip the ones that haven't changed */
+		if (rw == UIO_WRITE &&
+		    !bitmap_isset(sfs->sfs_freemapdirty, j)) {
+			continue;
+		}
+
 		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+		void *ptr = bitdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/* and read or write it. The bitmap starts at block 2. */ 
 		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j,
+					    sfs->sfs_blocksize);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j,
+					    sfs->sfs_blocksize);
 		}
 
 		/* If we failed, stop. */
 		if (result) {
 			return result;
 		}
+
+		if (rw == UIO_WRITE) {
+			bitmap_unmark(sfs->sfs_freemapdirty, j);
+		}
 	}
 	return 0;
 }
 
+/*
+ * Record that the freemap bit for BLOCK has changed, so that the
+ * bitmap block it's in gets written on the next sync.
+ */
+void
+sfs_mapdirty(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t mapblock = block / SFS_BLOCKBITS(sfs->sfs_blocksize);
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+
+	if (!bitmap_isset(sfs->sfs_freemapdirty, mapblock)) {
+		bitmap_mark(sfs->sfs_freemapdirty, mapblock);
+	}
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +144,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct vnodearray *tosync;
+	struct sfs_vnode *sv;
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +181,83 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+	/*
+	 * Sync the vnodes whose inodes are dirty. VOP_FSYNC takes the
+	 * vnode's lock, which comes before sfs_vnlock and
+	 * sfs_dirtylock, so we can't call it while looking at the
+	 * list. Instead, grab a reference to each dirty vnode into a
+	 * private array, and sync from that. Holding sfs_vnlock keeps
+	 * sfs_reclaim from freeing a vnode we're about to grab.
+	 *
+	 * Anything dirtied after we look at the list is left for the
+	 * next sync.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	num = sfs->sfs_ndirty;
+	spinlock_release(&sfs->sfs_dirtylock);
+
+	if (num > 0) {
+		tosync = vnodearray_create();
+		if (tosync == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
+		result = vnodearray_setsize(tosync, num);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			vnodearray_destroy(tosync);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
+
+		/* The list may have shrunk (but not grown) meanwhile */
+		i = 0;
+		spinlock_acquire(&sfs->sfs_dirtylock);
+		for (sv = sfs->sfs_dirtylist; sv != NULL && i < num;
+		     sv = sv->sv_dirtynext) {
+			VOP_INCREF(&sv->sv_v);
+			vnodearray_set(tosync, i++, &sv->sv_v);
+		}
+		spinlock_release(&sfs->sfs_dirtylock);
+		num = i;
+		lock_release(sfs->sfs_vnlock);
+
+		for (i=0; i<num; i++) {
+			struct vnode *v = vnodearray_get(tosync, i);
+			VOP_FSYNC(v);
+			VOP_DECREF(v);
+		}
+		vnodearray_setsize(tosync, 0);
+		vnodearray_destroy(tosync);
+	}
+	else {
+		lock_release(sfs->sfs_vnlock);
+	}
+
+	lock_acquire(sfs->sfs_fslock);
+
+	/* Write whatever parts of the free block map have changed. */
+	result = sfs_mapio(sfs, UIO_WRITE);
+	if (result) {
+		lock_release(sfs->sfs_fslock);
+		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION,
+				    sizeof(sfs->sfs_super));
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_fslock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_fslock);
+
+	/* Now push everything written above out of the buffer cache. */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
@@ -189,13 +270,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name doesn't change while mounted; no lock needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,31 +285,57 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	uint32_t i;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * mount table lock is held, so nobody can get a new vnode on
+	 * this fs while we're here.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Free any unlinked files still waiting, and write that out.
+	 * Sync even if there was nothing to drain: the orphan thread
+	 * may have finished freeing after VFS's sync, and sfs_sync
+	 * only writes what's dirty anyway.
+	 */
+	(void)sfs_orphan_drain(sfs);
+	result = sfs_sync(fs);
+	if (result) {
+		return result;
+	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_ndirty == 0);
+	KASSERT(sfs->sfs_nreserved == 0);
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		KASSERT(!bitmap_isset(sfs->sfs_freemapdirty, i));
+	}
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	bitmap_destroy(sfs->sfs_freemapdirty);
 	bitmap_destroy(sfs->sfs_freemap);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_fslock);
 	
+	/* Forget the (now clean) cached blocks */
+	buffer_invalidate(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
-	(void)sfs->sfs_device;
 
 	/* Destroy the fs object */
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -255,10 +358,9 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -270,42 +372,56 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices with the wrong sector size. A
+	 * filesystem block may be several sectors (see sp_blocksize),
+	 * but the superblock is always read as one sector.
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
+	/* Make sure there's a thread to free unlinked files */
+	result = sfs_orphan_init();
+	if (result) {
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* No vnodes loaded yet */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+
+	/* Allocate locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_fslock = lock_create("sfs_fs");
+	if (sfs->sfs_fslock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
 	/* Load superblock */
-	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION,
+			    sizeof(sfs->sfs_super));
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,15 +432,41 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_invalidate(dev);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
-	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
+
+	/*
+	 * Switch to the volume's block size. Block 0 was just read as
+	 * one sector; get rid of that buffer so it isn't confused
+	 * with the full-size block 0.
+	 */
+	sfs->sfs_blocksize = SFS_FSBLOCKSIZE(sfs->sfs_super.sp_blocksize);
+	for (sfs->sfs_blockshift = 0;
+	     (1U << sfs->sfs_blockshift) < sfs->sfs_blocksize;
+	     sfs->sfs_blockshift++);
+	if (sfs->sfs_blocksize != (1U << sfs->sfs_blockshift) ||
+	    sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+	    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE) {
+		kprintf("sfs: Bad block size %u in superblock\n",
+			sfs->sfs_blocksize);
+		buffer_invalidate(dev);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs);
+		return EINVAL;
+	}
+	sfs->sfs_dbperidb = SFS_DBPERIDB(sfs->sfs_blocksize);
+	buffer_invalidate(dev);
+
+	if (sfs->sfs_super.sp_nblocks >
+	    dev->d_blocks / (sfs->sfs_blocksize / dev->d_blocksize)) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
+			sfs->sfs_super.sp_nblocks,
+			dev->d_blocks / (sfs->sfs_blocksize / dev->d_blocksize));
 	}
 
 	/* Ensure null termination of the volume name */
@@ -333,20 +475,47 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_invalidate(dev);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_freemapdirty == NULL) {
+		buffer_invalidate(dev);
+		bitmap_destroy(sfs->sfs_freemap);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		buffer_invalidate(dev);
+		bitmap_destroy(sfs->sfs_freemapdirty);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_fslock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Count the free blocks; none are reserved yet */
+	sfs->sfs_nfree = 0;
+	for (i=0; i<sfs->sfs_super.sp_nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nreserved = 0;
+	sfs->sfs_norphans = 0;
+
+	/* No inodes dirty yet */
+	sfs->sfs_dirtylist = NULL;
+	sfs->sfs_ndirty = 0;
+	spinlock_init(&sfs->sfs_dirtylock);
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -356,12 +525,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* the other fields */
 	sfs->sfs_superdirty = false;
-	sfs->sfs_freemapdirty = false;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
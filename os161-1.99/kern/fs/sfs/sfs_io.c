@@ -30,78 +30,63 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <uio.h>
-#include <vfs.h>
-#include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
 //
+// These copy blocks in and out of the buffer cache, which does the
+// actual device I/O. Writes go to the disk when the cache evicts the
+// block or when sfs_sync calls buffer_sync.
+//
+// LEN is how much of the block to copy, from the start: the whole
+// block for freemap blocks, or SFS_BLOCKSIZE for the superblock and
+// inodes, which are that size whatever the volume's block size. When
+// writing less than a block, the rest of the block is zeroed.
+//
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device and sfs_blocksize.
 
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block, size_t len)
 {
+	struct buf *b;
 	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n", 
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	KASSERT(len <= sfs->sfs_blocksize);
 
- retry:
-	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: d_io returned EINVAL\n");
+	result = buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
 	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: block %llu I/O error, giving up after "
-				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
+	memcpy(data, buffer_map(b), len);
+	buffer_release(b);
+	return 0;
 }
 
 int
-sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
+sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
-
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
-}
+	struct buf *b;
+	char *ptr;
+	int result;
 
-int
-sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
-{
-	struct iovec iov;
-	struct uio ku;
+	KASSERT(len <= sfs->sfs_blocksize);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	/* We're overwriting the whole block, so don't bother reading it. */
+	result = buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
+	}
+	ptr = buffer_map(b);
+	memcpy(ptr, data, len);
+	bzero(ptr + len, sfs->sfs_blocksize - len);
+	buffer_mark_valid(b);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
@@ -41,9 +41,12 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
+#include "opt-sfsdebug.h"
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -53,28 +56,111 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/*
+ * File block number of, and offset within that block of, file offset
+ * OFF. (Shifts, because dividing an off_t needs 64-bit division.)
+ */
+#define SFS_OFFBLOCK(sfs, off) ((uint32_t)((off) >> (sfs)->sfs_blockshift))
+#define SFS_OFFSKIP(sfs, off) \
+	((uint32_t)((off) & ((sfs)->sfs_blocksize - 1)))
+
+/* Zero out a disk block (in the buffer cache; it's written later). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), sfs->sfs_blocksize);
+	buffer_mark_valid(b);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Put SV on, or take it off, the filesystem's list of vnodes with
+ * dirty inodes, which is what sfs_sync looks at.
+ */
+static
+void
+sfs_dirtylist_add(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtylist;
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtylist = sv;
+	sfs->sfs_ndirty++;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+static
+void
+sfs_dirtylist_remove(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		KASSERT(sfs->sfs_dirtylist == sv);
+		sfs->sfs_dirtylist = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+	KASSERT(sfs->sfs_ndirty > 0);
+	sfs->sfs_ndirty--;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/*
+ * Mark the inode dirty. The caller must hold sv_lock.
+ */
+static
+void
+sfs_dirty(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (!sv->sv_dirty) {
+		sv->sv_dirty = true;
+		sfs_dirtylist_add(sv);
+	}
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out to disk.
+ * The caller must hold sv_lock.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino,
+					sizeof(sv->sv_i));
 		if (result) {
 			return result;
 		}
 		sv->sv_dirty = false;
+		sfs_dirtylist_remove(sv);
 	}
 	return 0;
 }
@@ -84,19 +170,33 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block: the first free one at or after GOAL (wrapping
+ * around to the start of the disk if need be). Blocks promised to
+ * delayed writes (sfs_nreserved) are not available.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_fslock);
+	while (sfs->sfs_nfree <= sfs->sfs_nreserved) {
+		/* There may be space waiting to be freed */
+		lock_release(sfs->sfs_fslock);
+		if (!sfs_orphan_drain(sfs)) {
+			return ENOSPC;
+		}
+		lock_acquire(sfs->sfs_fslock);
+	}
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_fslock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs->sfs_nfree--;
+	sfs_mapdirty(sfs, *diskblock);
+	lock_release(sfs->sfs_fslock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -106,6 +206,39 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Free LEN consecutive blocks starting at START: one trip through
+ * sfs_fslock, with the freemap bits cleared a word at a time.
+ *
+ * Whatever is cached for the blocks is garbage now and mustn't be
+ * written, so it's dropped first. Once the bits are clear someone
+ * else can allocate a block and start using its buffer, and dropping
+ * it then would throw away their data.
+ */
+static
+void
+sfs_bfree_run(struct sfs_fs *sfs, uint32_t start, uint32_t len)
+{
+	uint32_t i, mapbits = SFS_BLOCKBITS(sfs->sfs_blocksize);
+
+	if (len == 0) {
+		return;
+	}
+
+	for (i=0; i<len; i++) {
+		buffer_drop(sfs->sfs_device, start + i, sfs->sfs_blocksize);
+	}
+
+	lock_acquire(sfs->sfs_fslock);
+	bitmap_unmarkrange(sfs->sfs_freemap, start, len);
+	sfs->sfs_nfree += len;
+	/* one call per freemap block the run touches */
+	for (i = start - start % mapbits; i < start + len; i += mapbits) {
+		sfs_mapdirty(sfs, i);
+	}
+	lock_release(sfs->sfs_fslock);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +246,152 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_bfree_run(sfs, diskblock, 1);
+}
+
+/*
+ * Freeing many blocks (truncating or erasing a file). The blocks of a
+ * file are mostly consecutive, so they're collected into a run, which
+ * is freed with sfs_bfree_run when a block that doesn't extend it
+ * comes along, and at the end with sfs_freerun_flush.
+ *
+ * Nothing in a run may be busy in the buffer cache when the run is
+ * flushed, so add an indirect block only after releasing it.
+ */
+struct sfs_freerun {
+	uint32_t fr_start;		/* first block */
+	uint32_t fr_len;		/* number of blocks, or 0 */
+};
+
+static
+void
+sfs_freerun_flush(struct sfs_fs *sfs, struct sfs_freerun *fr)
+{
+	sfs_bfree_run(sfs, fr->fr_start, fr->fr_len);
+	fr->fr_len = 0;
+}
+
+static
+void
+sfs_freerun_add(struct sfs_fs *sfs, struct sfs_freerun *fr, uint32_t block)
+{
+	if (fr->fr_len > 0 && block == fr->fr_start + fr->fr_len) {
+		fr->fr_len++;
+		return;
+	}
+	sfs_freerun_flush(sfs, fr);
+	fr->fr_start = block;
+	fr->fr_len = 1;
+}
+
+/*
+ * Preallocation.
+ *
+ * When a file is being written sequentially, reserve the next few
+ * free blocks after the one just allocated, so the file stays
+ * contiguous even if other files are being written at the same time.
+ * The reserved blocks are marked in the freemap but are not in the
+ * file; they are handed out in order as the file grows and given
+ * back as soon as the file is written anywhere else, truncated, or
+ * reclaimed.
+ *
+ * If the system crashes, reserved blocks that were synced to disk
+ * show up as used-but-unreferenced; sfsck reclaims them.
+ */
+#define SFS_PREALLOC	8	/* max blocks reserved per file */
+
+/*
+ * Reserve up to SFS_PREALLOC free blocks starting at START for SV.
+ * Stops at the first block that's already in use.
+ */
+static
+void
+sfs_prealloc(struct sfs_vnode *sv, uint32_t start)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_npreall == 0);
+
+	lock_acquire(sfs->sfs_fslock);
+	for (n=0; n<SFS_PREALLOC; n++) {
+		if (start+n >= sfs->sfs_super.sp_nblocks ||
+		    bitmap_isset(sfs->sfs_freemap, start+n) ||
+		    sfs->sfs_nfree <= sfs->sfs_nreserved) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, start+n);
+		sfs->sfs_nfree--;
+		sfs_mapdirty(sfs, start+n);
+	}
+	lock_release(sfs->sfs_fslock);
+
+	sv->sv_preall = start;
+	sv->sv_npreall = n;
+}
+
+/*
+ * Give back SV's reserved blocks, if any.
+ */
+static
+void
+sfs_prealloc_discard(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sfs_bfree_run(sfs, sv->sv_preall, sv->sv_npreall);
+	sv->sv_npreall = 0;
+}
+
+/*
+ * Allocate a data block to be block FILEBLOCK of file SV.
+ *
+ * Take it from the file's reservation if the file is being written
+ * sequentially; otherwise, take the first free block after the last
+ * one allocated to the file, and if this write was sequential,
+ * reserve some more behind it.
+ */
+static
+int
+sfs_dalloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	bool sequential;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sequential = (fileblock == sv->sv_nextfblock);
+	if (!sequential) {
+		sfs_prealloc_discard(sv);
+	}
+
+	if (sv->sv_npreall > 0) {
+		*diskblock = sv->sv_preall;
+		sv->sv_preall++;
+		sv->sv_npreall--;
+		result = sfs_clearblock(sfs, *diskblock);
+		if (result) {
+			sfs_bfree(sfs, *diskblock);
+			return result;
+		}
+	}
+	else {
+		result = sfs_balloc(sfs, sv->sv_goal, diskblock);
+		if (result) {
+			return result;
+		}
+		if (sequential) {
+			sfs_prealloc(sv, *diskblock + 1);
+		}
+	}
+
+	sv->sv_goal = *diskblock + 1;
+	sv->sv_nextfblock = fileblock + 1;
+	return 0;
 }
 
 /*
@@ -124,44 +401,153 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_fslock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_fslock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Block trees.
+ *
+ * After the SFS_NDIRECT direct blocks, a file's blocks are found
+ * through three trees of indirect blocks, hanging off sfi_indirect
+ * (one level), sfi_dindirect (two levels) and sfi_tindirect (three
+ * levels). SFS_IBSPAN(sfs, n) is how many file blocks one entry in an
+ * indirect block n levels above the data covers.
+ *
+ * With large blocks the triple indirect tree covers more blocks than
+ * a uint32_t can count (and more than a file can have), so sizes of
+ * whole trees are only compared by dividing by the span.
+ */
+#define SFS_IBSPAN(sfs, n) \
+	((n) == 1 ? 1 : (n) == 2 ? (sfs)->sfs_dbperidb : \
+	 (sfs)->sfs_dbperidb * (sfs)->sfs_dbperidb)
+
+/*
+ * Work out which of inode SFI's trees FILEBLOCK (which is not a direct
+ * block) is in. Returns the number of levels of indirect blocks in
+ * that tree, and sets *ROOT to the inode's pointer to its top and
+ * *BASE to the file block number of its first block; or returns 0 if
+ * FILEBLOCK is past the largest possible file.
+ */
+static
+unsigned
+sfs_ibtree(struct sfs_fs *sfs, struct sfs_inode *sfi, uint32_t fileblock,
+	   uint32_t **root, uint32_t *base)
+{
+	uint32_t start = SFS_NDIRECT;
+	uint32_t span;
+	unsigned levels;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+
+	for (levels = 1; levels <= 3; levels++) {
+		span = SFS_IBSPAN(sfs, levels);
+		if ((fileblock - start) / span < sfs->sfs_dbperidb) {
+			break;
+		}
+		start += sfs->sfs_dbperidb * span;
+	}
+	switch (levels) {
+	    case 1: *root = &sfi->sfi_indirect; break;
+	    case 2: *root = &sfi->sfi_dindirect; break;
+	    case 3: *root = &sfi->sfi_tindirect; break;
+	    default: return 0;
+	}
+	*base = start;
+	return levels;
+}
+
+/*
+ * Indirect block cache.
+ *
+ * Each vnode keeps a copy of the last bottom-level indirect block
+ * sfs_bmap went through, so a file read or written sequentially only
+ * walks its block trees once per indirect block's worth instead of
+ * once per block. Only sfs_bmap changes indirect blocks, apart from
+ * truncation, which just throws the copy away.
+ */
+struct sfs_ibcache {
+	uint32_t ic_block;		/* disk block copied, or 0 */
+	uint32_t ic_base;		/* file block ic_ptrs[0] is for */
+	uint32_t ic_ptrs[];		/* the copy (sfs_dbperidb entries) */
+};
+
+/*
+ * Look up FILEBLOCK in SV's cache. Returns true if it was there.
+ */
+static
+bool
+sfs_ibcache_get(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_ibcache *ic = sv->sv_ibcache;
+
+	if (ic == NULL || ic->ic_block == 0 || fileblock < ic->ic_base ||
+	    fileblock - ic->ic_base >= sfs->sfs_dbperidb) {
+		return false;
+	}
+	*diskblock = ic->ic_ptrs[fileblock - ic->ic_base];
+	return true;
+}
+
+/*
+ * Remember bottom-level indirect block IDBLOCK, whose first entry is
+ * for file block BASE and whose contents are IDDATA.
+ */
+static
+void
+sfs_ibcache_put(struct sfs_vnode *sv, uint32_t idblock, uint32_t base,
+		const uint32_t *iddata)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_ibcache == NULL) {
+		sv->sv_ibcache = kmalloc(sizeof(struct sfs_ibcache) +
+					 sfs->sfs_blocksize);
+		if (sv->sv_ibcache == NULL) {
+			/* never mind */
+			return;
+		}
+	}
+	sv->sv_ibcache->ic_block = idblock;
+	sv->sv_ibcache->ic_base = base;
+	memcpy(sv->sv_ibcache->ic_ptrs, iddata, sfs->sfs_blocksize);
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, along with any indirect blocks needed to hold its
+ * number. The caller must hold sv_lock.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *root;
+	uint32_t block, base, offset, idx;
+	unsigned levels, level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,110 +562,95 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_dalloc(sv, fileblock, &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
-		}
-
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
+			sfs_dirty(sv);
 		}
-		*diskblock = block;
-		return 0;
+		goto done;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
-		return EFBIG;
+	/* Try the cached indirect block first */
+	if (sfs_ibcache_get(sv, fileblock, &block) &&
+	    (block != 0 || !doalloc)) {
+		goto done;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	/* Find the tree, and the block's place in it */
+	levels = sfs_ibtree(sfs, &sv->sv_i, fileblock, &root, &base);
+	if (levels == 0) {
+		return EFBIG;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	offset = fileblock - base;
+
+	/* Get the top indirect block, allocating it if need be */
+	block = *root;
+	if (block == 0) {
+		if (!doalloc) {
+			/*
+			 * There's no indirect block allocated, so
+			 * pretend it was filled with all zeros.
+			 */
+			goto done;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		result = sfs_balloc(sfs, sv->sv_goal, &block);
 		if (result) {
 			return result;
 		}
+		*root = block;
+		sfs_dirty(sv);
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	/*
+	 * Walk down the tree. BLOCK is the indirect block at LEVEL; on
+	 * the way out of the loop it's the data block. Each indirect
+	 * block is kept busy while allocating the one below it, so the
+	 * new block's number can be stored in it. If we just allocated
+	 * an indirect block, sfs_balloc zeroed it in the buffer cache,
+	 * so reading it doesn't go to disk.
+	 */
+	for (level = levels; level > 0; level--) {
+		result = buffer_read(sfs->sfs_device, block,
+				     sfs->sfs_blocksize, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
+		idx = (offset / SFS_IBSPAN(sfs, level)) % sfs->sfs_dbperidb;
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		if (iddata[idx] == 0 && doalloc) {
+			if (level == 1) {
+				result = sfs_dalloc(sv, fileblock,
+						    &iddata[idx]);
+			}
+			else {
+				result = sfs_balloc(sfs, sv->sv_goal,
+						    &iddata[idx]);
+			}
+			if (result) {
+				iddata[idx] = 0;
+				buffer_release(idbuf);
+				return result;
+			}
+			buffer_mark_dirty(idbuf);
+		}
+		if (level == 1) {
+			sfs_ibcache_put(sv, block, fileblock - idx, iddata);
+		}
+		block = iddata[idx];
+		buffer_release(idbuf);
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (block == 0) {
+			/* A hole */
+			break;
 		}
 	}
 
+ done:
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
@@ -291,88 +662,712 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 
 ////////////////////////////////////////////////////////////
 //
-// File-level I/O
+// Delayed allocation
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Writes to parts of a regular file that have no disk block yet
+ * (appends, mostly) don't allocate one right away. The data is kept
+ * in a delayed block, in memory, belonging to the vnode; the disk
+ * blocks are allocated when the delayed blocks are flushed, which
+ * happens on sync/fsync (at the latest when the syncer runs), when
+ * the vnode is reclaimed, or when the vnode has SFS_DELAYMAX of them
+ * and needs another. Flushing allocates in file block order, so a
+ * file written in dribs and drabs still gets contiguous blocks from
+ * sfs_dalloc, and a new block starts out as zeros in memory instead
+ * of being read from disk and written back for every small write.
  *
- * skipstart is the number of bytes to skip past at the beginning of
- * the sector; len is the number of bytes to actually read or write.
- * uio is the area to do the I/O into.
+ * So that a write that has succeeded can't fail later for lack of
+ * space, each delayed block reserves the space it might need (itself,
+ * plus the indirect blocks above it) in sfs_nreserved, which
+ * sfs_balloc won't dip into.
+ *
+ * Directories don't do this; the directory code looks up blocks
+ * with sfs_bmap directly.
  */
-static
-int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
-{
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
-	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+#define SFS_DELAYMAX	16	/* max delayed blocks per vnode */
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+struct sfs_dblock {
+	uint32_t db_fileblock;		/* block number within the file */
+	unsigned db_nres;		/* disk blocks reserved for it */
+	char *db_data;			/* the contents */
+};
 
-	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+/*
+ * Return the delayed block for FILEBLOCK of SV, or NULL.
+ */
+static
+struct sfs_dblock *
+sfs_delayed_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	unsigned i;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		if (sv->sv_delayed[i].db_fileblock == fileblock) {
+			return &sv->sv_delayed[i];
+		}
 	}
+	return NULL;
+}
+
+/*
+ * Give up the space reserved for a delayed block and free it.
+ */
+static
+void
+sfs_delayed_free(struct sfs_fs *sfs, struct sfs_dblock *db)
+{
+	lock_acquire(sfs->sfs_fslock);
+	KASSERT(sfs->sfs_nreserved >= db->db_nres);
+	sfs->sfs_nreserved -= db->db_nres;
+	lock_release(sfs->sfs_fslock);
+	kfree(db->db_data);
+}
+
+/*
+ * Allocate disk blocks for all of SV's delayed blocks, and move the
+ * data into the buffer cache. The caller must hold sv_lock.
+ */
+static
+int
+sfs_delayed_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db;
+	struct buf *b;
+	uint32_t diskblock;
+	unsigned i, j;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		db = &sv->sv_delayed[i];
 
-	if (diskblock == 0) {
 		/*
-		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back the reservation just before allocating,
+		 * so sfs_balloc can use it. If the allocation fails
+		 * anyway, take it back and keep the rest for later.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		lock_acquire(sfs->sfs_fslock);
+		sfs->sfs_nreserved -= db->db_nres;
+		lock_release(sfs->sfs_fslock);
+
+		result = sfs_bmap(sv, db->db_fileblock, 1, &diskblock);
+		if (result == 0) {
+			result = buffer_get(sfs->sfs_device, diskblock,
+					    sfs->sfs_blocksize, &b);
+		}
+		if (result) {
+			lock_acquire(sfs->sfs_fslock);
+			sfs->sfs_nreserved += db->db_nres;
+			lock_release(sfs->sfs_fslock);
+			break;
+		}
+		memcpy(buffer_map(b), db->db_data, sfs->sfs_blocksize);
+		buffer_mark_valid(b);
+		buffer_mark_dirty(b);
+		buffer_release(b);
+
+		kfree(db->db_data);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
+
+	/* Keep whatever didn't make it */
+	for (j=0; i<sv->sv_ndelayed; i++, j++) {
+		sv->sv_delayed[j] = sv->sv_delayed[i];
+	}
+	sv->sv_ndelayed = j;
+	return result;
+}
+
+/*
+ * Throw away SV's delayed blocks from FILEBLOCK on; for truncate.
+ */
+static
+void
+sfs_delayed_discard(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* They're sorted, so the ones to go are at the end */
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		if (sv->sv_delayed[i].db_fileblock >= fileblock) {
+			break;
+		}
+	}
+	while (sv->sv_ndelayed > i) {
+		sv->sv_ndelayed--;
+		sfs_delayed_free(sfs, &sv->sv_delayed[sv->sv_ndelayed]);
+	}
+}
+
+/*
+ * Make a new (zero-filled) delayed block for FILEBLOCK of SV, which
+ * must not have a disk block or a delayed block already.
+ */
+static
+int
+sfs_delayed_add(struct sfs_vnode *sv, uint32_t fileblock,
+		struct sfs_dblock **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t *root, base;
+	unsigned i, nres;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * Reserve the block, and every indirect block above it in case
+	 * none of them exist yet. (This overestimates, but only by a
+	 * few blocks per delayed block.)
+	 */
+	nres = 1;
+	if (fileblock >= SFS_NDIRECT) {
+		i = sfs_ibtree(sfs, &sv->sv_i, fileblock, &root, &base);
+		if (i == 0) {
+			return EFBIG;
+		}
+		nres += i;
+	}
+
+	if (sv->sv_delayed == NULL) {
+		sv->sv_delayed = kmalloc(SFS_DELAYMAX *
+					 sizeof(struct sfs_dblock));
+		if (sv->sv_delayed == NULL) {
+			return ENOMEM;
+		}
+	}
+	else if (sv->sv_ndelayed == SFS_DELAYMAX) {
+		result = sfs_delayed_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	data = kmalloc(sfs->sfs_blocksize);
+	if (data == NULL) {
+		return ENOMEM;
+	}
+	bzero(data, sfs->sfs_blocksize);
+
+	lock_acquire(sfs->sfs_fslock);
+	while (sfs->sfs_nfree - sfs->sfs_nreserved < nres) {
+		lock_release(sfs->sfs_fslock);
+		if (!sfs_orphan_drain(sfs)) {
+			kfree(data);
+			return ENOSPC;
+		}
+		lock_acquire(sfs->sfs_fslock);
+	}
+	sfs->sfs_nreserved += nres;
+	lock_release(sfs->sfs_fslock);
+
+	/* Keep them in file block order */
+	for (i = sv->sv_ndelayed; i > 0; i--) {
+		if (sv->sv_delayed[i-1].db_fileblock < fileblock) {
+			break;
+		}
+		KASSERT(sv->sv_delayed[i-1].db_fileblock != fileblock);
+		sv->sv_delayed[i] = sv->sv_delayed[i-1];
+	}
+	sv->sv_delayed[i].db_fileblock = fileblock;
+	sv->sv_delayed[i].db_nres = nres;
+	sv->sv_delayed[i].db_data = data;
+	sv->sv_ndelayed++;
+
+	/* So sfs_sync gets to it */
+	sfs_dirty(sv);
+
+	*ret = &sv->sv_delayed[i];
+	return 0;
+}
+
+/*
+ * Do I/O on part of a file block that has no disk block: LEN bytes,
+ * SKIP bytes into block FILEBLOCK. Reads come from the delayed block
+ * if there is one and are zeros otherwise; writes go to the delayed
+ * block, which is made if need be.
+ */
+static
+int
+sfs_delayed_io(struct sfs_vnode *sv, struct uio *uio, uint32_t fileblock,
+	       uint32_t skip, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db;
+	int result;
+
+	KASSERT(skip + len <= sfs->sfs_blocksize);
+
+	db = sfs_delayed_find(sv, fileblock);
+	if (db == NULL) {
+		if (uio->uio_rw == UIO_READ) {
+			return uiomovezeros(len, uio);
+		}
+		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_FILE);
+		result = sfs_delayed_add(sv, fileblock, &db);
 		if (result) {
 			return result;
 		}
 	}
+	return uiomove(db->db_data + skip, len, uio);
+}
+
+/*
+ * Free the blocks from file block BLOCKLEN on in the part of a block
+ * tree under *IENTRY, an indirect block LEVEL levels above the data
+ * whose first entry is for file block BASE, adding them to FR. If
+ * that leaves it empty, free it too, clear *IENTRY, and set *CHANGED.
+ */
+static
+int
+sfs_truncate_ib(struct sfs_fs *sfs, uint32_t *ientry, unsigned level,
+		uint32_t base, uint32_t blocklen, struct sfs_freerun *fr,
+		bool *changed)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, span, idblock;
+	bool iddirty = false, hasnonzero = false;
+	int result = 0;
+
+	idblock = *ientry;
+	span = SFS_IBSPAN(sfs, level);
+	if (idblock == 0 ||
+	    (blocklen >= base && (blocklen - base) / span >= sfs->sfs_dbperidb)) {
+		/* Nothing here, or nothing past the new EOF */
+		return 0;
+	}
+
+	result = buffer_read(sfs->sfs_device, idblock, sfs->sfs_blocksize,
+			     &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	for (j=0; j<sfs->sfs_dbperidb; j++) {
+		if (level == 1) {
+			/* Discard any data blocks past the new EOF */
+			if (base + j >= blocklen && iddata[j] != 0) {
+				sfs_freerun_add(sfs, fr, iddata[j]);
+				iddata[j] = 0;
+				iddirty = true;
+			}
+		}
+		else if (result == 0) {
+			result = sfs_truncate_ib(sfs, &iddata[j], level - 1,
+						 base + j * span, blocklen,
+						 fr, &iddirty);
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	/* (release before freeing, which drops it from the cache) */
+	buffer_release(idbuf);
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_freerun_add(sfs, fr, idblock);
+		*ientry = 0;
+		*changed = true;
+	}
+	return result;
+}
+
+/*
+ * Free the blocks of inode SFI from file block BLOCKLEN on, and any
+ * indirect blocks that leaves empty. Sets *CHANGED if that changed
+ * SFI. The caller must keep anyone else from using SFI's blocks.
+ */
+static
+int
+sfs_freeblocks(struct sfs_fs *sfs, struct sfs_inode *sfi, uint32_t blocklen,
+	       bool *changed)
+{
+	struct sfs_freerun fr;
+	uint32_t i, block, base;
+	uint32_t *root;
+	unsigned levels;
+	int result = 0;
+
+	fr.fr_len = 0;
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sfi->sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_freerun_add(sfs, &fr, block);
+			sfi->sfi_direct[i] = 0;
+			*changed = true;
+		}
+	}
+
+	/* Then each of the block trees, the single indirect one first */
+	i = SFS_NDIRECT;
+	do {
+		levels = sfs_ibtree(sfs, sfi, i, &root, &base);
+		KASSERT(levels != 0);
+		result = sfs_truncate_ib(sfs, root, levels, base, blocklen,
+					 &fr, changed);
+		i = base + sfs->sfs_dbperidb * SFS_IBSPAN(sfs, levels);
+	} while (result == 0 && levels < 3);
+
+	sfs_freerun_flush(sfs, &fr);
+	return result;
+}
+
+/*
+ * Truncate a file, freeing any blocks past the new end. Used by
+ * ftruncate() and by sfs_reclaim. The caller must hold sv_lock.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = SFS_OFFBLOCK(sfs, len + sfs->sfs_blocksize - 1);
+	uint32_t lenskip = SFS_OFFSKIP(sfs, len);
+
+	bool changed = false;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Whatever we'd reserved for the file to grow into is moot now. */
+	sfs_prealloc_discard(sv);
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Drop delayed blocks past the end, and zero the part past the
+	 * end of one that the end falls in, so it reads as zeros if
+	 * the file grows again.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	sfs_delayed_discard(sv, blocklen);
+	if (lenskip != 0) {
+		struct sfs_dblock *db = sfs_delayed_find(sv, blocklen - 1);
+
+		if (db != NULL) {
+			bzero(db->db_data + lenskip,
+			      sfs->sfs_blocksize - lenskip);
+		}
+	}
+
+	/* The cached indirect block may be about to change or go away */
+	if (sv->sv_ibcache != NULL) {
+		sv->sv_ibcache->ic_block = 0;
+	}
+
+	result = sfs_freeblocks(sfs, &sv->sv_i, blocklen, &changed);
+	if (changed) {
+		sfs_dirty(sv);
+	}
 	if (result) {
 		return result;
 	}
 
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* Mark the inode dirty */
+	sfs_dirty(sv);
+
+	return 0;
+}
+
+/*
+ * Freeing unlinked files in the background.
+ *
+ * When the last reference to a file with no links goes away, its
+ * blocks aren't freed on the spot; that could take a long time for a
+ * big file, holding up the process that removed it (and, since
+ * sfs_reclaim holds sfs_vnlock, every vnode load on the fs). Instead
+ * sfs_reclaim writes out the inode as it is and queues its number
+ * for the orphan thread, which frees the blocks and then the inode.
+ * The space shows up as free once that's done; anyone who runs out
+ * of space meanwhile, and unmount, frees what's queued themselves
+ * with sfs_orphan_drain rather than wait.
+ *
+ * The queue (in no particular order) and each fs's sfs_norphans,
+ * which counts its orphans queued or being freed, are protected by
+ * sfs_orphanlock. Nothing is acquired while holding it. An orphan's
+ * inode and blocks belong to whoever took it off the queue.
+ */
+struct sfs_orphan {
+	struct sfs_fs *so_fs;		/* filesystem */
+	uint32_t so_ino;		/* inode number */
+	struct sfs_orphan *so_next;	/* queue link */
+};
+
+static struct lock *sfs_orphanlock;
+static struct cv *sfs_orphancv;		/* signalled when one is queued */
+static struct cv *sfs_orphandonecv;	/* signalled when one is freed */
+static struct sfs_orphan *sfs_orphanq;
+
+/*
+ * Free inode INO of SFS and all its blocks.
+ */
+static
+void
+sfs_orphan_free(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_inode sfi;
+	bool changed = false;
+	int result;
+
+	result = sfs_rblock(sfs, &sfi, ino, sizeof(sfi));
+	if (result == 0) {
+		result = sfs_freeblocks(sfs, &sfi, 0, &changed);
+		if (result && changed) {
+			/* Don't leave it pointing at freed blocks */
+			(void)sfs_wblock(sfs, &sfi, ino, sizeof(sfi));
+		}
+	}
+	if (result) {
+		kprintf("sfs: %s: Error freeing unlinked inode %u: %s\n",
+			sfs->sfs_super.sp_volname, ino, strerror(result));
+		kprintf("sfs: %s: Run sfsck to get the space back\n",
+			sfs->sfs_super.sp_volname);
+		return;
+	}
+	sfs_bfree(sfs, ino);
+}
+
+/*
+ * Mark SO finished.
+ */
+static
+void
+sfs_orphan_done(struct sfs_orphan *so)
+{
+	lock_acquire(sfs_orphanlock);
+	KASSERT(so->so_fs->sfs_norphans > 0);
+	so->so_fs->sfs_norphans--;
+	cv_broadcast(sfs_orphandonecv, sfs_orphanlock);
+	lock_release(sfs_orphanlock);
+	kfree(so);
+}
+
+/*
+ * The orphan thread.
+ */
+static
+void
+sfs_orphan_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_orphan *so;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(sfs_orphanlock);
+		while (sfs_orphanq == NULL) {
+			cv_wait(sfs_orphancv, sfs_orphanlock);
+		}
+		so = sfs_orphanq;
+		sfs_orphanq = so->so_next;
+		lock_release(sfs_orphanlock);
+
+		sfs_orphan_free(so->so_fs, so->so_ino);
+		sfs_orphan_done(so);
+	}
+}
+
+/*
+ * Start the orphan thread, if it isn't running yet. Called at mount
+ * time (with the VFS mount table lock held, so only once at a time).
+ */
+int
+sfs_orphan_init(void)
+{
+	int result;
+
+	if (sfs_orphanlock != NULL) {
+		return 0;
+	}
+
+	sfs_orphancv = cv_create("sfs_orphans");
+	sfs_orphandonecv = cv_create("sfs_orphansdone");
+	if (sfs_orphancv == NULL || sfs_orphandonecv == NULL) {
+		goto fail;
+	}
+	sfs_orphanlock = lock_create("sfs_orphans");
+	if (sfs_orphanlock == NULL) {
+		goto fail;
+	}
+	result = thread_fork("sfs_orphans", NULL, sfs_orphan_thread, NULL, 0);
+	if (result) {
+		lock_destroy(sfs_orphanlock);
+		sfs_orphanlock = NULL;
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	if (sfs_orphandonecv != NULL) {
+		cv_destroy(sfs_orphandonecv);
+		sfs_orphandonecv = NULL;
+	}
+	if (sfs_orphancv != NULL) {
+		cv_destroy(sfs_orphancv);
+		sfs_orphancv = NULL;
+	}
+	return ENOMEM;
+}
+
+/*
+ * Queue inode INO of SFS to be freed, using SO (from kmalloc).
+ */
+static
+void
+sfs_orphan_add(struct sfs_fs *sfs, struct sfs_orphan *so, uint32_t ino)
+{
+	so->so_fs = sfs;
+	so->so_ino = ino;
+
+	lock_acquire(sfs_orphanlock);
+	so->so_next = sfs_orphanq;
+	sfs_orphanq = so;
+	sfs->sfs_norphans++;
+	cv_signal(sfs_orphancv, sfs_orphanlock);
+	lock_release(sfs_orphanlock);
+}
+
+/*
+ * Free all of SFS's orphans now, and wait for any the orphan thread
+ * is working on. Returns true if there were any. The caller must not
+ * hold sfs_fslock.
+ */
+bool
+sfs_orphan_drain(struct sfs_fs *sfs)
+{
+	struct sfs_orphan *mine = NULL, *so, **pp;
+	bool any;
+
+	lock_acquire(sfs_orphanlock);
+	any = sfs->sfs_norphans > 0;
+	pp = &sfs_orphanq;
+	while (*pp != NULL) {
+		so = *pp;
+		if (so->so_fs == sfs) {
+			*pp = so->so_next;
+			so->so_next = mine;
+			mine = so;
+		}
+		else {
+			pp = &so->so_next;
+		}
+	}
+	lock_release(sfs_orphanlock);
+
+	while (mine != NULL) {
+		so = mine;
+		mine = so->so_next;
+		sfs_orphan_free(sfs, so->so_ino);
+		sfs_orphan_done(so);
+	}
+
+	lock_acquire(sfs_orphanlock);
+	while (sfs->sfs_norphans > 0) {
+		cv_wait(sfs_orphandonecv, sfs_orphanlock);
+	}
+	lock_release(sfs_orphanlock);
+
+	return any;
+}
+
+////////////////////////////////////////////////////////////
+//
+// File-level I/O
+
+/*
+ * Do I/O to a block of a file that doesn't cover the whole block.  We
+ * need to read in the original block first, even if we're writing, so
+ * we don't clobber the portion of the block we're not intending to
+ * write over.
+ *
+ * skipstart is the number of bytes to skip past at the beginning of
+ * the sector; len is the number of bytes to actually read or write.
+ * uio is the area to do the I/O into.
+ */
+static
+int
+sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
+	      uint32_t skipstart, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *iodata;
+	uint32_t diskblock;
+	uint32_t fileblock;
+	int result;
+	
 	/*
-	 * If it was a write, write back the modified block.
+	 * Allocate missing blocks if and only if we're writing, and
+	 * not to a regular file (which gets a delayed block instead).
+	 */
+	int doalloc = (uio->uio_rw==UIO_WRITE &&
+		       sv->sv_i.sfi_type != SFS_TYPE_FILE);
+
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
+
+	/* Compute the block offset of this block in the file */
+	fileblock = SFS_OFFBLOCK(sfs, uio->uio_offset);
+
+	/* Get the disk block number */
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	if (result) {
+		return result;
+	}
+
+	if (diskblock == 0) {
+		/*
+		 * There was no block mapped at this point in the file,
+		 * so it lives in a delayed block or reads as zeros.
+		 */
+		return sfs_delayed_io(sv, uio, fileblock, skipstart, len);
+	}
+
+	/*
+	 * Get the block from the buffer cache.
+	 */
+	result = buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			     &iobuf);
+	if (result) {
+		return result;
+	}
+	iodata = buffer_map(iobuf);
+
+	/*
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(iodata+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty. (Even if the
+	 * copy failed partway; some of it may have been changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,17 +1378,15 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	int doalloc = (uio->uio_rw==UIO_WRITE &&
+		       sv->sv_i.sfi_type != SFS_TYPE_FILE);
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = SFS_OFFBLOCK(sfs, uio->uio_offset);
 
 	/* Look up the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -401,57 +1394,65 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return result;
 	}
 
-	if (diskblock == 0) {
+	if (diskblock == 0) {
+		/* No block - use the delayed block, or zeros. */
+		return sfs_delayed_io(sv, uio, fileblock, 0,
+				      sfs->sfs_blocksize);
+	}
+
+	/*
+	 * Go through the buffer cache. A whole-block write replaces
+	 * the contents entirely, so there's no need to read first.
+	 */
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock,
+				     sfs->sfs_blocksize, &b);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock,
+				    sfs->sfs_blocksize, &b);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(buffer_map(b), sfs->sfs_blocksize, uio);
+	if (uio->uio_rw == UIO_WRITE) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * If the copy failed partway, a block that wasn't
+		 * cached is left invalid, to be reread later; one that
+		 * was cached has been partly overwritten and must be
+		 * written back like any other partial write.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		if (result == 0) {
+			buffer_mark_valid(b);
+		}
+		if (buffer_isvalid(b)) {
+			buffer_mark_dirty(b);
+		}
 	}
-
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	buffer_release(b);
 
 	return result;
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The caller must hold sv_lock.
  */
 static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -476,13 +1477,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = SFS_OFFSKIP(sfs, uio->uio_offset);
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -504,8 +1505,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(SFS_OFFSKIP(sfs, uio->uio_offset) == 0);
+	nblocks = uio->uio_resid >> sfs->sfs_blockshift;
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -516,7 +1517,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -531,7 +1532,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -541,105 +1542,607 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read-ahead.
+ *
+ * A read that starts in the block where the previous read on the
+ * same file ended (or the block after it) is taken to be sequential.
+ * Each sequential read doubles the number of blocks kept read ahead
+ * of the reader, up to SFS_RAMAX; anything else turns read-ahead off
+ * until the file is read sequentially again. The reads themselves are
+ * done in the background by the buffer cache; here we only decide
+ * which blocks to ask for. To keep the requests in batches, more are
+ * only asked for once the reader has used up half the window.
+ *
+ * This is per vnode rather than per open file (which SFS never sees),
+ * so two processes reading the same file at different places will
+ * mostly just turn each other's read-ahead off.
+ */
+#define SFS_RAMIN	2	/* window on the first sequential read */
+#define SFS_RAMAX	8192	/* largest window in bytes (but >= SFS_RAMIN
+				   blocks); the buffer cache is small */
+
+/*
+ * Called after reading bytes [START, END) of SV.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, next, last, fileblock, diskblock, ramax, eofblock;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (end <= start || start >= sv->sv_i.sfi_size) {
+		return;
+	}
+	first = SFS_OFFBLOCK(sfs, start);
+	next = SFS_OFFBLOCK(sfs, end + sfs->sfs_blocksize - 1);
+	ramax = SFS_RAMAX >> sfs->sfs_blockshift;
+	if (ramax < SFS_RAMIN) {
+		ramax = SFS_RAMIN;
+	}
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < ramax) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = next;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+	if (sv->sv_raend < next) {
+		sv->sv_raend = next;
+	}
+	else if (sv->sv_raend - next >= sv->sv_rawindow / 2) {
+		/* still enough in hand */
+		return;
+	}
+
+	/* Don't go past EOF */
+	last = next + sv->sv_rawindow;
+	eofblock = SFS_OFFBLOCK(sfs, (off_t)sv->sv_i.sfi_size +
+			       sfs->sfs_blocksize - 1);
+	if (last > eofblock) {
+		last = eofblock;
+	}
+
+	for (fileblock = sv->sv_raend; fileblock < last; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock,
+					 sfs->sfs_blocksize);
+		}
+	}
+	sv->sv_raend = fileblock;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Read the directory entry out of slot SLOT of a directory vnode.
+ * The "slot" is the index of the directory entry, starting at 0.
+ */
+static
+int
+sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t actualpos;
+	int result;
+
+	/* Compute the actual position in the directory to read. */
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the read */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* We should not hit EOF in the middle of a directory entry */
+	if (ku.uio_resid > 0) {
+		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Write (overwrite) the directory entry in slot SLOT of a directory
+ * vnode.
+ */
+static
+int
+sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t actualpos;
+	int result;
+
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the write */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Directory iterator.
+ *
+ * Walks the entries of a directory a block at a time: each block is
+ * fetched from the buffer cache once and its entries are handed out
+ * straight from the buffer, instead of going through sfs_io for every
+ * 64-byte entry. Empty slots are returned too (with sfd_ino ==
+ * SFS_NOINO), so callers can look for free space.
+ *
+ *    sfs_diriter_start - Begin at slot SLOT of directory SV.
+ *    sfs_diriter_next  - Hand back a pointer to the next entry and its
+ *                        slot number, or NULL at the end of the
+ *                        directory. The entry may only be looked at
+ *                        until the next call or sfs_diriter_end.
+ *    sfs_diriter_end   - Release the current block.
+ *
+ * The caller must hold the directory's sv_lock throughout, and must
+ * not do other I/O on the directory until calling sfs_diriter_end,
+ * since the iterator keeps the current block's buffer busy.
+ */
+struct sfs_diriter {
+	struct sfs_vnode *di_sv;        /* directory */
+	int di_nentries;                /* slots in directory */
+	int di_slot;                    /* next slot to hand back */
+	struct buf *di_buf;             /* block of di_slot, or NULL */
+	const struct sfs_dir *di_ents;  /* entries in current block */
+};
+
+#define SFS_DIRPERBLOCK(sfs)  ((sfs)->sfs_blocksize / sizeof(struct sfs_dir))
+
+static
+void
+sfs_diriter_start(struct sfs_diriter *di, struct sfs_vnode *sv, int slot)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(slot >= 0);
+
+	di->di_sv = sv;
+	di->di_nentries = sfs_dir_nentries(sv);
+	di->di_slot = slot;
+	di->di_buf = NULL;
+	di->di_ents = NULL;
+}
+
+static
+void
+sfs_diriter_end(struct sfs_diriter *di)
+{
+	if (di->di_buf != NULL) {
+		buffer_release(di->di_buf);
+		di->di_buf = NULL;
+	}
+	di->di_ents = NULL;
+}
+
+static
+int
+sfs_diriter_next(struct sfs_diriter *di, const struct sfs_dir **ret,
+		 int *slot)
+{
+	/* A hole in a directory reads as empty entries. */
+	static const struct sfs_dir
+		zeroblock[SFS_MAXBLOCKSIZE / sizeof(struct sfs_dir)];
+
+	struct sfs_fs *sfs = di->di_sv->sv_v.vn_fs->fs_data;
+	uint32_t diskblock;
+	unsigned ix;
+	int result;
+
+	if (di->di_slot >= di->di_nentries) {
+		sfs_diriter_end(di);
+		*ret = NULL;
+		return 0;
+	}
+
+	ix = di->di_slot % SFS_DIRPERBLOCK(sfs);
+
+	/* Moving into a new block? Let go of the old one, get the new one. */
+	if (ix == 0 || di->di_ents == NULL) {
+		sfs_diriter_end(di);
+
+		result = sfs_bmap(di->di_sv, di->di_slot / SFS_DIRPERBLOCK(sfs),
+				  0, &diskblock);
+		if (result) {
+			return result;
+		}
+		if (diskblock == 0) {
+			di->di_ents = zeroblock;
+		}
+		else {
+			result = buffer_read(sfs->sfs_device, diskblock,
+					     sfs->sfs_blocksize, &di->di_buf);
+			if (result) {
+				return result;
+			}
+			di->di_ents = buffer_map(di->di_buf);
+		}
+	}
+
+	*ret = &di->di_ents[ix];
+	*slot = di->di_slot;
+	di->di_slot++;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory name hash
+
+/*
+ * In-memory index of a directory's entries, built the first time the
+ * directory is searched and kept up to date by sfs_dir_link and
+ * sfs_dir_unlink. It lets a lookup go straight to the slots whose
+ * name hashes the same instead of reading every entry, and lets
+ * sfs_dir_link find a free slot without a scan.
+ *
+ * The index records, for each slot, only the hash of the name in it
+ * and a link to the next slot on the same chain; the names stay on
+ * disk (well, in the buffer cache) and a slot whose hash matches is
+ * read to compare the name. Used slots are chained off the hash
+ * buckets; free slots are chained together on dh_freelist. A chain
+ * ends with -1.
+ *
+ * Protected by the directory's sv_lock.
+ *
+ * If we run out of memory building or growing the index, the
+ * directory just goes without one, and sfs_dir_findname falls back to
+ * scanning.
+ */
+struct sfs_dirhash {
+	unsigned dh_nslots;     /* slots in the directory */
+	unsigned dh_maxslots;   /* allocated size of dh_next and dh_hash */
+	unsigned dh_nused;      /* slots that hold a name */
+	unsigned dh_nbuckets;   /* size of dh_buckets; a power of 2 */
+	int *dh_buckets;        /* first slot on each hash chain */
+	int *dh_next;           /* next slot on the same chain */
+	uint32_t *dh_hash;      /* hash of the name in each used slot */
+	int dh_freelist;        /* first free slot */
+};
+
+#define SFS_DIRHASH_MINBUCKETS  16
+
+static
+uint32_t
+sfs_dirhash_name(const char *name)
+{
+	uint32_t h = 0;
+
+	while (*name) {
+		h = h*31 + (unsigned char)*name;
+		name++;
+	}
+	return h;
+}
+
+static
+void
+sfs_dirhash_destroy(struct sfs_dirhash *dh)
+{
+	kfree(dh->dh_buckets);
+	kfree(dh->dh_next);
+	kfree(dh->dh_hash);
+	kfree(dh);
+}
+
+/*
+ * Make room for at least NSLOTS slots.
+ */
+static
+int
+sfs_dirhash_grow(struct sfs_dirhash *dh, unsigned nslots)
+{
+	unsigned newmax;
+	int *newnext;
+	uint32_t *newhash;
+
+	if (nslots <= dh->dh_maxslots) {
+		return 0;
+	}
+
+	newmax = dh->dh_maxslots > 0 ? dh->dh_maxslots : 16;
+	while (newmax < nslots) {
+		newmax *= 2;
+	}
+
+	newnext = kmalloc(newmax * sizeof(int));
+	if (newnext == NULL) {
+		return ENOMEM;
+	}
+	newhash = kmalloc(newmax * sizeof(uint32_t));
+	if (newhash == NULL) {
+		kfree(newnext);
+		return ENOMEM;
+	}
+	if (dh->dh_nslots > 0) {
+		memcpy(newnext, dh->dh_next, dh->dh_nslots * sizeof(int));
+		memcpy(newhash, dh->dh_hash, 
+		       dh->dh_nslots * sizeof(uint32_t));
+	}
+	kfree(dh->dh_next);
+	kfree(dh->dh_hash);
+	dh->dh_next = newnext;
+	dh->dh_hash = newhash;
+	dh->dh_maxslots = newmax;
+	return 0;
+}
+
+/*
+ * Put SLOT, which holds a name with hash HASH, on its hash chain.
+ */
+static
+void
+sfs_dirhash_insert(struct sfs_dirhash *dh, int slot, uint32_t hash)
+{
+	unsigned b = hash & (dh->dh_nbuckets - 1);
+
+	dh->dh_hash[slot] = hash;
+	dh->dh_next[slot] = dh->dh_buckets[b];
+	dh->dh_buckets[b] = slot;
+	dh->dh_nused++;
+}
+
+/*
+ * Redistribute the used slots over NBUCKETS buckets.
+ */
+static
+int
+sfs_dirhash_rehash(struct sfs_dirhash *dh, unsigned nbuckets)
+{
+	int *oldbuckets;
+	unsigned oldnbuckets, i;
+	int slot, next;
+
+	oldbuckets = dh->dh_buckets;
+	oldnbuckets = dh->dh_nbuckets;
+
+	dh->dh_buckets = kmalloc(nbuckets * sizeof(int));
+	if (dh->dh_buckets == NULL) {
+		dh->dh_buckets = oldbuckets;
+		return ENOMEM;
+	}
+	for (i=0; i<nbuckets; i++) {
+		dh->dh_buckets[i] = -1;
+	}
+	dh->dh_nbuckets = nbuckets;
+	dh->dh_nused = 0;
+
+	for (i=0; i<oldnbuckets; i++) {
+		for (slot = oldbuckets[i]; slot >= 0; slot = next) {
+			next = dh->dh_next[slot];
+			sfs_dirhash_insert(dh, slot, dh->dh_hash[slot]);
+		}
+	}
+	kfree(oldbuckets);
+	return 0;
+}
+
+/*
+ * Build the index for directory SV by reading all its entries.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_dirhash_build(struct sfs_vnode *sv)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
+	struct sfs_dirhash *dh;
+	struct sfs_diriter di;
+	const struct sfs_dir *sd;
+	char name[SFS_NAMELEN];
+	unsigned nbuckets;
+	int nentries = sfs_dir_nentries(sv);
+	int i, freetail, result;
 
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+	KASSERT(sv->sv_dirhash == NULL);
 
-	/* do it */
-	result = sfs_io(sv, &ku);
+	dh = kmalloc(sizeof(struct sfs_dirhash));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	dh->dh_nslots = 0;
+	dh->dh_maxslots = 0;
+	dh->dh_nused = 0;
+	dh->dh_nbuckets = 0;
+	dh->dh_buckets = NULL;
+	dh->dh_next = NULL;
+	dh->dh_hash = NULL;
+	dh->dh_freelist = -1;
+
+	/* Aim for chains of about 2, as sfs_dirhash_added does. */
+	nbuckets = SFS_DIRHASH_MINBUCKETS;
+	while (2*nbuckets < (unsigned)nentries) {
+		nbuckets *= 2;
+	}
+	result = sfs_dirhash_rehash(dh, nbuckets);
+	if (result) {
+		kfree(dh);
+		return result;
+	}
+	result = sfs_dirhash_grow(dh, nentries);
 	if (result) {
+		sfs_dirhash_destroy(dh);
 		return result;
 	}
+	dh->dh_nslots = nentries;
 
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	/*
+	 * Append free slots to the tail of the free list, so it comes
+	 * out in ascending order and new entries fill the lowest free
+	 * slot first.
+	 */
+	freetail = -1;
+	sfs_diriter_start(&di, sv, 0);
+	while (1) {
+		result = sfs_diriter_next(&di, &sd, &i);
+		if (result) {
+			sfs_diriter_end(&di);
+			sfs_dirhash_destroy(dh);
+			return result;
+		}
+		if (sd == NULL) {
+			break;
+		}
+		if (sd->sfd_ino == SFS_NOINO) {
+			dh->dh_next[i] = -1;
+			if (freetail < 0) {
+				dh->dh_freelist = i;
+			}
+			else {
+				dh->dh_next[freetail] = i;
+			}
+			freetail = i;
+		}
+		else {
+			/* Ensure null termination, just in case */
+			memcpy(name, sd->sfd_name, sizeof(name));
+			name[sizeof(name)-1] = 0;
+			sfs_dirhash_insert(dh, i, sfs_dirhash_name(name));
+		}
 	}
 
-	/* Done */
+	sv->sv_dirhash = dh;
 	return 0;
 }
 
 /*
- * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * Update the index after sfs_dir_link wrote NAME into SLOT.
  */
 static
-int
-sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+void
+sfs_dirhash_added(struct sfs_vnode *sv, int slot, const char *name)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
-
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the write */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+	struct sfs_dirhash *dh = sv->sv_dirhash;
 
-	/* do it */
-	result = sfs_io(sv, &ku);
-	if (result) {
-		return result;
+	if (dh == NULL) {
+		return;
 	}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	if ((unsigned)slot < dh->dh_nslots) {
+		/* sfs_dir_findname always hands out the first free slot */
+		KASSERT(slot == dh->dh_freelist);
+		dh->dh_freelist = dh->dh_next[slot];
+	}
+	else {
+		KASSERT((unsigned)slot == dh->dh_nslots);
+		if (sfs_dirhash_grow(dh, dh->dh_nslots + 1)) {
+			/* Out of memory; do without. */
+			sfs_dirhash_destroy(dh);
+			sv->sv_dirhash = NULL;
+			return;
+		}
+		dh->dh_nslots++;
 	}
 
-	/* Done */
-	return 0;
+	sfs_dirhash_insert(dh, slot, sfs_dirhash_name(name));
+
+	/* Keep the chains short; if we can't, they'll just be longer. */
+	if (dh->dh_nused > 2*dh->dh_nbuckets) {
+		(void)sfs_dirhash_rehash(dh, 2*dh->dh_nbuckets);
+	}
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Update the index after sfs_dir_unlink cleared SLOT.
  */
 static
-int
-sfs_dir_nentries(struct sfs_vnode *sv)
+void
+sfs_dirhash_removed(struct sfs_vnode *sv, int slot)
 {
-	off_t size;
+	struct sfs_dirhash *dh = sv->sv_dirhash;
+	int *pp;
 
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	if (dh == NULL) {
+		return;
+	}
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	KASSERT((unsigned)slot < dh->dh_nslots);
+	pp = &dh->dh_buckets[dh->dh_hash[slot] & (dh->dh_nbuckets - 1)];
+	while (*pp != slot) {
+		KASSERT(*pp >= 0);
+		pp = &dh->dh_next[*pp];
 	}
+	*pp = dh->dh_next[slot];
+	dh->dh_nused--;
 
-	return size / sizeof(struct sfs_dir);
+	/*
+	 * Put it at the head of the free list. This breaks the
+	 * ascending order, but reusing the slot we just freed is as
+	 * good as anything.
+	 */
+	dh->dh_next[slot] = dh->dh_freelist;
+	dh->dh_freelist = slot;
 }
 
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * Uses the directory's name hash, building it if necessary; if there
+ * isn't memory for it, reads every slot instead.
  */
 
 static
@@ -647,19 +2150,69 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dirhash *dh;
+	struct sfs_diriter di;
+	const struct sfs_dir *sd;
 	struct sfs_dir tsd;
+	uint32_t hash;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirhash == NULL) {
+		result = sfs_dirhash_build(sv);
+		if (result && result != ENOMEM) {
+			return result;
+		}
+	}
+
+	dh = sv->sv_dirhash;
+	if (dh != NULL) {
+		if (emptyslot != NULL && dh->dh_freelist >= 0) {
+			*emptyslot = dh->dh_freelist;
+		}
+
+		hash = sfs_dirhash_name(name);
+		i = dh->dh_buckets[hash & (dh->dh_nbuckets - 1)];
+		for (; i >= 0; i = dh->dh_next[i]) {
+			if (dh->dh_hash[i] != hash) {
+				continue;
+			}
+			result = sfs_readdir(sv, &tsd, i);
+			if (result) {
+				return result;
+			}
+			KASSERT(tsd.sfd_ino != SFS_NOINO);
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (!strcmp(tsd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = i;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+				return 0;
+			}
+		}
+		return ENOENT;
+	}
+
 	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	sfs_diriter_start(&di, sv, 0);
+	while (1) {
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
+		/* Get the entry from that slot */
+		result = sfs_diriter_next(&di, &sd, &i);
 		if (result) {
+			sfs_diriter_end(&di);
 			return result;
 		}
+		if (sd == NULL) {
+			break;
+		}
+		memcpy(&tsd, sd, sizeof(tsd));
+
 		if (tsd.sfd_ino == SFS_NOINO) {
 			/* Free slot - report it back if one was requested */
 			if (emptyslot != NULL) {
@@ -729,8 +2282,13 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	sfs_dirhash_added(sv, emptyslot, name);
+	return 0;
 }
 
 /*
@@ -741,13 +2299,20 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	sfs_dirhash_removed(sv, slot);
+	return 0;
 }
 
 /*
@@ -801,7 +2366,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -890,69 +2455,112 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **pp;
+	struct sfs_orphan *orphan = NULL;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from finding it while we look.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Nobody else has a reference, so this can't block for long. */
+	lock_acquire(sv->sv_lock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	sfs_prealloc_discard(sv);
+
+	/*
+	 * If there are no on-disk references to the file either, it
+	 * is to be erased: throw away the delayed blocks, and leave
+	 * the rest to the orphan thread (or, if we can't queue it, do
+	 * it now). Otherwise, give the delayed blocks disk blocks.
+	 */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+		orphan = kmalloc(sizeof(struct sfs_orphan));
+		if (orphan != NULL) {
+			sfs_delayed_discard(sv, 0);
+			result = 0;
+		}
+		else {
+			result = sfs_dotruncate(sv, 0);
 		}
 	}
+	else {
+		result = sfs_delayed_flush(sv);
+	}
+	if (result) {
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		return result;
+	}
+	KASSERT(sv->sv_ndelayed == 0);
 
-	/* Sync the inode to disk */
+	/* Sync the inode to disk; this also takes it off the dirty list */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		if (orphan != NULL) {
+			kfree(orphan);
+		}
 		return result;
 	}
+	KASSERT(!sv->sv_dirty);
+
+	lock_release(sv->sv_lock);
 
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+		if (orphan != NULL) {
+			sfs_orphan_add(sfs, orphan, sv->sv_ino);
+		}
+		else {
+			sfs_bfree(sfs, sv->sv_ino);
+		}
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	pp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
+		pp = &(*pp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*pp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
 
 	/* Release the storage for the vnode structure itself. */
+	if (sv->sv_dirhash != NULL) {
+		sfs_dirhash_destroy(sv->sv_dirhash);
+	}
+	if (sv->sv_delayed != NULL) {
+		kfree(sv->sv_delayed);
+	}
+	if (sv->sv_ibcache != NULL) {
+		kfree(sv->sv_ibcache);
+	}
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -960,24 +2568,86 @@ sfs_reclaim(struct vnode *v)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Called for read(). sfs_io() does the work; then start reading
+ * ahead if it looks like the file is being read sequentially.
  */
 static
 int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start = uio->uio_offset;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
+/*
+ * Called for getdirentry(). The offset in the uio is the slot number
+ * to start looking at; we hand back the name in the first used slot
+ * at or after it, and set the offset to the slot after that. At the
+ * end of the directory, nothing is transferred.
+ */
+static
+int
+sfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_diriter di;
+	const struct sfs_dir *sd;
+	char name[SFS_NAMELEN];
+	int slot, result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	if (uio->uio_offset < 0 || uio->uio_offset > 0x7fffffff) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+
+	sfs_diriter_start(&di, sv, uio->uio_offset);
+	do {
+		result = sfs_diriter_next(&di, &sd, &slot);
+		if (result) {
+			sfs_diriter_end(&di);
+			lock_release(sv->sv_lock);
+			return result;
+		}
+	} while (sd != NULL && sd->sfd_ino == SFS_NOINO);
+
+	if (sd == NULL) {
+		/* End of directory */
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+
+	/* Copy the name out before letting go of the buffer. */
+	memcpy(name, sd->sfd_name, sizeof(name));
+	name[sizeof(name)-1] = 0;
+	sfs_diriter_end(&di);
+
+	lock_release(sv->sv_lock);
+
+	result = uiomove(name, strlen(name), uio);
+	if (result) {
+		return result;
+	}
+
+	/* uiomove advanced the offset by the length; we want the slot. */
+	uio->uio_offset = slot + 1;
+	return 0;
+}
+
 /*
  * Called for write(). sfs_io() does the work.
  */
@@ -990,9 +2660,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1023,6 +2693,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -1033,12 +2704,17 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
 	statbuf->st_blocks = 0;
 
+	/* Whole blocks are the cheapest size to read and write in */
+	statbuf->st_blksize = sfs->sfs_blocksize;
+
 	/* Fill in other field as desired/possible... */
 
 	return 0;
@@ -1053,16 +2729,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1102,9 +2775,12 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_lock);
+	result = sfs_delayed_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1121,107 +2797,20 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
 
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
-	}
-
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
-	}
-
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
-
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1259,37 +2848,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +2887,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* Update the linkcount of the new file */
+	/*
+	 * Update the linkcount of the new file, and consequently mark
+	 * it dirty. Do this before letting go of the directory, so
+	 * nobody can look up the name and find a link count of 0.
+	 */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
+	sfs_dirty(newguy);
+	lock_release(newguy->sv_lock);
 
-	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	lock_release(sv->sv_lock);
 
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1331,20 +2923,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No hard links to directories (we'd deadlock on our own lock). */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
 
 	/* Just create a link */
+	lock_acquire(sv->sv_lock);
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2958,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2971,18 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty(victim);
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +3002,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +3031,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty(g1);
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +3046,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty(g1);
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +3070,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +3094,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +3106,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +3123,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1619,7 +3219,7 @@ static const struct vnode_ops sfs_dirops = {
 	
 	ISDIR,   /* read */
 	ISDIR,   /* readlink */
-	UNIMP,   /* getdirentry */
+	sfs_getdirentry,
 	ISDIR,   /* write */
 	sfs_ioctl,
 	sfs_stat,
@@ -1651,25 +3251,29 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned bucket;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Hold the table lock across the search and the load, so two
+	 * threads can't load the same inode twice, and so sfs_reclaim
+	 * can't tear down a vnode we're about to hand out.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Look in the vnodes table */
+	bucket = ino % SFS_VNHASHSIZE;
+	for (sv = sfs->sfs_vnhash[bucket]; sv != NULL; sv = sv->sv_hashnext) {
 
+#if OPT_SFSDEBUG
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
+#endif
 
 		if (sv->sv_ino==ino) {
 			/* Found */
@@ -1678,6 +3282,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +3292,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1696,15 +3302,44 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino);
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_rblock(sfs, &sv->sv_i, ino, sizeof(sv->sv_i));
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+
+	/* Directory name hash is built on first use */
+	sv->sv_dirhash = NULL;
+
+	/* Put the file's data near its inode; nothing reserved yet */
+	sv->sv_goal = ino + 1;
+	sv->sv_nextfblock = 0;
+	sv->sv_preall = 0;
+	sv->sv_npreall = 0;
+
+	/* No delayed blocks, and no indirect block cached */
+	sv->sv_delayed = NULL;
+	sv->sv_ndelayed = 0;
+	sv->sv_ibcache = NULL;
+
+	/* No read-ahead until the file is seen to be read sequentially */
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -1714,7 +3349,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		sv->sv_dirty = true;	/* put on the dirty list below */
 	}
 
 	/*
@@ -1736,7 +3371,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,13 +3381,15 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	sv->sv_hashnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	sfs->sfs_nvnodes++;
+	if (sv->sv_dirty) {
+		sfs_dirtylist_add(sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +3406,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -0,0 +1,79 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * A fixed-size pool of in-memory copies of disk blocks, indexed by
+ * (device, block number) through a hash table and recycled in LRU
+ * order. Writes are write-back: a buffer marked dirty is written to
+ * the device when it is evicted or when the owning filesystem calls
+ * buffer_sync().
+ *
+ * A buffer handed out by buffer_get() or buffer_read() is "busy":
+ * nobody else can get it until it is handed back with
+ * buffer_release(). Busy buffers are never evicted. Do not hold more
+ * than BUFFER_MAXHOLD buffers busy at once, and do not wait for one
+ * buffer while holding another unless the two are always taken in the
+ * same order (e.g. indirect block, then data block).
+ *
+ * Block numbers are in units of the buffer size, which is chosen by
+ * the caller (it is the filesystem's block size) and must be a
+ * multiple of the device's sector size.
+ *
+ * Functions:
+ *     buffer_get     - Get a busy buffer for BLOCK without reading it;
+ *                      for callers that are going to overwrite the
+ *                      whole block. Check buffer_isvalid() if you
+ *                      need to know whether it was already cached.
+ *     buffer_read    - Get a busy buffer for BLOCK and make sure it
+ *                      holds the block's contents.
+ *     buffer_map     - Get a pointer to the buffer's data.
+ *     buffer_isvalid - True if the buffer holds the block's contents.
+ *     buffer_mark_valid - Declare that the data is now good (after
+ *                      filling in a buffer from buffer_get).
+ *     buffer_mark_dirty - Declare that the data has been changed and
+ *                      must eventually be written back.
+ *     buffer_release - Give a busy buffer back.
+ *     buffer_readahead - Start reading BLOCK into the cache in the
+ *                      background, if it isn't there already; for
+ *                      blocks the caller expects to want soon.
+ *     buffer_drop    - Forget about BLOCK, discarding any changes;
+ *                      for blocks the filesystem has freed.
+ *     buffer_sync    - Write back all dirty buffers for a device.
+ *     buffer_invalidate - Discard all (clean) buffers for a device,
+ *                      and any read-ahead for it; for unmount.
+ *     buffer_printstats - Print hit/miss/eviction counts.
+ */
+
+/*
+ * Most buffers one thread may hold busy at once. (SFS holds three when
+ * truncating a triple indirect block tree.) The cache always has room
+ * for a few threads holding this many.
+ */
+#define BUFFER_MAXHOLD 3
+
+struct device;	/* from <device.h> */
+struct buf;	/* opaque */
+
+void buffer_bootstrap(void);
+
+int buffer_get(struct device *dev, uint32_t block, size_t size,
+	       struct buf **ret);
+int buffer_read(struct device *dev, uint32_t block, size_t size,
+		struct buf **ret);
+void *buffer_map(struct buf *b);
+bool buffer_isvalid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_readahead(struct device *dev, uint32_t block, size_t size);
+
+void buffer_drop(struct device *dev, uint32_t block, size_t size);
+int buffer_sync(struct device *dev);
+void buffer_invalidate(struct device *dev);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
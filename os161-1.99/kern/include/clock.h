@@ -56,6 +56,13 @@
 #define HZ  100
 #endif
 
+/*
+ * Count of hardclock ticks since boot, as seen by CPU 0. Suitable for
+ * coarse timing (e.g. lock statistics), not for anything that needs
+ * to be exact.
+ */
+extern volatile uint32_t hardclock_ticks;
+
 void hardclock_bootstrap(void);
 
 void hardclock(void);
@@ -45,6 +45,28 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	struct lock *ev_lock;		/* file I/O and size */
+	off_t ev_size;			/* file size, if ev_sizevalid */
+	bool ev_sizevalid;		/* ev_size has been fetched */
+};
+
+/*
+ * Cached file data (see emu.c). Each fs has a fixed number of pages,
+ * whose memory is allocated the first time each is used.
+ */
+#define EMUFS_PAGESHIFT 12
+#define EMUFS_PAGESIZE  (1 << EMUFS_PAGESHIFT)
+#define EMUFS_NPAGES    16
+
+struct emufs_page {
+	struct emufs_vnode *ep_vn;	/* file, or NULL if unused */
+	uint32_t ep_pageno;		/* page number in the file */
+	uint32_t ep_len;		/* bytes of the page in the file */
+	bool ep_dirty;			/* needs writing back */
+	bool ep_busy;			/* being moved to or from the host */
+	char *ep_data;			/* EMUFS_PAGESIZE bytes, or NULL */
+	struct emufs_page *ep_lruprev;	/* LRU list */
+	struct emufs_page *ep_lrunext;
 };
 
 struct emufs_fs {
@@ -52,7 +74,20 @@ struct emufs_fs {
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	struct lock *ef_cachelock;	/* page cache */
+	struct cv *ef_cachecv;		/* for waiting on busy pages */
+	struct emufs_page ef_pages[EMUFS_NPAGES];
+	struct emufs_page *ef_lruhead;	/* most recently used first */
+	struct emufs_page *ef_lrutail;
+	unsigned ef_hits;		/* pages found in the cache */
+	unsigned ef_misses;		/* pages read in */
+
+	struct emufs_fs *ef_next;	/* list of all emufs */
 };
 
+/* Print operation and cache statistics for each emufs. */
+void emufs_printstats(void);
+
 
 #endif /* _EMUFS_H_ */
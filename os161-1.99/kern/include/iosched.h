@@ -0,0 +1,74 @@
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Disk I/O scheduler.
+ *
+ * Keeps a disk's pending requests in C-LOOK order: ascending by
+ * sector from just past the last request handed to the hardware, then
+ * wrapping around to the lowest sector and ascending again. Requests
+ * for adjacent sectors therefore end up next to each other, and go to
+ * the disk back to back.
+ *
+ * The scheduler doesn't do any locking of its own; the driver calls
+ * it with the lock that protects its queue held (it may be called
+ * from the driver's interrupt handler). It also doesn't own the
+ * request structures; the driver embeds a struct ioreq in its own
+ * request structure.
+ *
+ * Each scheduler keeps statistics (queue depth, time spent queued,
+ * time spent being serviced) that iosched_printstats prints for all
+ * disks.
+ *
+ * Functions:
+ *     iosched_init    - Set up a scheduler for the disk called NAME.
+ *     iosched_cleanup - Tear it down; the queue must be empty.
+ *     iosched_add     - Queue a request.
+ *     iosched_next    - Take the next request to service off the
+ *                       queue, or return NULL if it's empty.
+ *     iosched_done    - Report that a request taken with
+ *                       iosched_next has finished.
+ *     iosched_printstats - Print statistics for every disk.
+ */
+
+struct ioreq {
+	struct ioreq *ir_next;		/* queue link */
+	uint32_t ir_sector;		/* first sector */
+	uint32_t ir_nsect;		/* number of sectors */
+	bool ir_write;			/* direction */
+
+	/* for statistics */
+	time_t ir_qsecs;		/* when queued */
+	uint32_t ir_qnsecs;
+	time_t ir_ssecs;		/* when handed to the hardware */
+	uint32_t ir_snsecs;
+};
+
+struct iosched {
+	char is_name[16];		/* device name */
+	struct ioreq *is_queue;		/* pending requests, C-LOOK order */
+	uint32_t is_head;		/* sort requests starting here first */
+	unsigned is_depth;		/* requests queued or in service */
+	struct iosched *is_nextsched;	/* list of all schedulers */
+
+	/* statistics */
+	unsigned is_nreqs;		/* requests completed */
+	unsigned is_nbatched;		/* requests that joined a neighbor */
+	uint32_t is_nsectors;		/* sectors in completed requests */
+	unsigned is_maxdepth;		/* largest is_depth seen */
+	uint32_t is_depthsum;		/* sum of is_depth on arrival */
+	uint32_t is_waitus;		/* total usec queued */
+	uint32_t is_svcus;		/* total usec in service */
+};
+
+void iosched_init(struct iosched *is, const char *name);
+void iosched_cleanup(struct iosched *is);
+
+void iosched_add(struct iosched *is, struct ioreq *req);
+struct ioreq *iosched_next(struct iosched *is);
+void iosched_done(struct iosched *is, struct ioreq *req);
+
+void iosched_printstats(void);
+
+
+#endif /* _IOSCHED_H_ */
@@ -37,27 +37,44 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* default (and smallest) block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * The block size of a volume is recorded in its superblock. It is a
+ * power of two between SFS_BLOCKSIZE and SFS_MAXBLOCKSIZE; volumes
+ * made before it was recorded have 0 there and use SFS_BLOCKSIZE.
+ * The superblock and inodes are SFS_BLOCKSIZE bytes long whatever
+ * the block size; each sits at the start of its block, and the rest
+ * of the block is zero.
+ *
+ * The macros below take the block size as BS.
+ */
+#define SFS_FSBLOCKSIZE(sp_blocksize) \
+	((sp_blocksize) == 0 ? SFS_BLOCKSIZE : (sp_blocksize))
+
+/* # direct blks per indirect blk */
+#define SFS_DBPERIDB(bs)  ((bs) / sizeof(uint32_t))
+
 /* Number of bits in a block */
-#define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BLOCKBITS(bs) ((bs) * CHAR_BIT)
 
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
 /* Size of bitmap (in bits) */
-#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS)
+#define SFS_BITMAPSIZE(nblocks, bs) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS(bs))
 
 /* Size of bitmap (in blocks) */
-#define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
+#define SFS_BITBLOCKS(nblocks, bs) \
+	(SFS_BITMAPSIZE(nblocks, bs)/SFS_BLOCKBITS(bs))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -71,7 +88,8 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_blocksize;			/* Block size, or 0 (see above) */
+	uint32_t reserved[117];
 };
 
 /*
@@ -83,9 +101,15 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/* Tell sfsck about the double and triple indirect blocks */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /*
  * On-disk directory entry
  */
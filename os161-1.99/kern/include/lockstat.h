@@ -0,0 +1,52 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling.
+ *
+ * Each struct lock and struct semaphore carries a struct lockstat,
+ * registered under the lock's name when the lock is created and
+ * unregistered when it is destroyed. Spinlocks have no name and are
+ * often statically initialized, so they are only profiled if someone
+ * attaches a lockstat to them with spinlock_setstat().
+ *
+ * Counters are updated while holding the lock being profiled, so they
+ * need no locking of their own. Times are in hardclock ticks.
+ *
+ * The registry (the list of all lockstats) has its own spinlock,
+ * which is deliberately not profiled.
+ */
+
+#define LOCKSTAT_NAMELEN 24
+
+struct lockstat {
+	char ls_name[LOCKSTAT_NAMELEN];	/* copy of the lock's name */
+	unsigned ls_acquires;		/* number of acquisitions */
+	unsigned ls_contended;		/* acquisitions that had to wait */
+	uint32_t ls_waitticks;		/* total ticks spent waiting */
+	uint32_t ls_maxhold;		/* longest hold, in ticks */
+	uint32_t ls_heldsince;		/* tick of latest acquisition */
+	struct lockstat *ls_prev;	/* registry links */
+	struct lockstat *ls_next;
+};
+
+/* Add to or remove from the registry. */
+void lockstat_register(struct lockstat *ls, const char *name);
+void lockstat_unregister(struct lockstat *ls);
+
+/*
+ * Record an acquisition. STARTED is the tick count when the caller
+ * began trying; CONTENDED is true if it had to wait.
+ */
+void lockstat_acquired(struct lockstat *ls, bool contended, uint32_t started);
+
+/* Record a release, for the hold time. */
+void lockstat_released(struct lockstat *ls);
+
+/*
+ * Print the N most contended locks, then zero all the counters.
+ */
+void lockstat_dump(unsigned n);
+
+
+#endif /* _LOCKSTAT_H_ */
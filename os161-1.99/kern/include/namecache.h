@@ -0,0 +1,57 @@
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Name lookup cache.
+ *
+ * Remembers the results of VOP_LOOKUP: for a directory vnode and the
+ * name that was looked up in it (the rest of the path, which may have
+ * several components on filesystems that take whole paths), the vnode
+ * found, or that the lookup failed with ENOENT. The cache holds a
+ * reference to both vnodes. It has a fixed number of entries, reused
+ * least recently used first, and only takes names up to
+ * NAMECACHE_NAMELEN characters long; longer ones always go to the
+ * filesystem.
+ *
+ * Since a name may span several directories, the cache can't tell
+ * which entries a change to one directory affects. So anything that
+ * removes or renames a name drops everything cached for that
+ * filesystem, and anything that creates a name drops that
+ * filesystem's failed lookups. Changes are rare next to lookups.
+ *
+ * Functions:
+ *     namecache_bootstrap - Set up; called by vfs_bootstrap.
+ *     namecache_lookup    - Look up NAME in DIR. Returns true on a hit
+ *                           and sets *RET to the vnode, with a new
+ *                           reference, or to NULL if the name doesn't
+ *                           exist. On a miss, sets *GEN for passing to
+ *                           namecache_enter.
+ *     namecache_enter     - Add the result of a lookup that missed:
+ *                           the vnode VN (NULL for ENOENT) that NAME
+ *                           names in DIR. Does nothing if anything was
+ *                           purged since the miss, since the result
+ *                           may be out of date.
+ *     namecache_purge     - Drop the entries for filesystem FS (or all
+ *                           filesystems, if NULL): all of them, or
+ *                           only the failed lookups if NEGONLY.
+ *     namecache_printstats - Print hit rates.
+ *
+ * No locks may be held when calling namecache_purge, except the VFS
+ * mount table lock; it drops vnode references, which may reclaim them.
+ */
+
+#define NAMECACHE_NAMELEN 31
+
+struct fs;
+struct vnode;
+
+void namecache_bootstrap(void);
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret, unsigned *gen);
+void namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		     unsigned gen);
+void namecache_purge(struct fs *fs, bool negonly);
+void namecache_printstats(void);
+
+
+#endif /* _NAMECACHE_H_ */
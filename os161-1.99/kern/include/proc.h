@@ -62,7 +62,7 @@ struct semaphore;
 	};
 
 	struct array *processTable;
-	struct lock *procTableLock;
+	struct rwlock *procTableLock;
 	struct ProcHolder *getProcHolder(struct array *hayStack, int needle);
 	void nextFreePIDSetProc(struct array *processTable, struct ProcHolder *procHolder);
 	void printArr(void);
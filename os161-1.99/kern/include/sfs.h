@@ -39,6 +39,7 @@
 /*
  * Get abstract structure definitions
  */
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -48,21 +49,98 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dirhash;	/* private to sfs_vnode.c */
+struct sfs_dblock;	/* private to sfs_vnode.c */
+struct sfs_ibcache;	/* private to sfs_vnode.c */
+
+/*
+ * Locking. SFS does not use vfs_biglock. There are three kinds of
+ * sleep lock, acquired in this order:
+ *
+ *   1. sv_lock, one per vnode, protects sv_i and sv_dirty, and with
+ *      them the file's contents and indirect block. Reads and writes
+ *      of a file take only its sv_lock. Directory operations take
+ *      the directory's sv_lock first, then the sv_lock of any file
+ *      they change the link count of.
+ *
+ *   2. sfs_vnlock, one per fs, protects the table of loaded vnodes
+ *      (sfs_vnhash), so that an inode is loaded at most once and a
+ *      vnode isn't found while it is being reclaimed. sfs_reclaim
+ *      holds it while taking the sv_lock of the vnode being
+ *      reclaimed; that is safe because nobody else has a reference
+ *      to that vnode and so nobody can hold or be waiting for its
+ *      lock.
+ *
+ *   3. sfs_fslock, one per fs, protects the freemap, the superblock,
+ *      their dirty flags, and the free and reserved block counts.
+ *      Nothing else is acquired while holding it except buffer cache
+ *      buffers for the freemap and superblock.
+ *
+ * sfs_orphanlock (in sfs_vnode.c) protects the queue of unlinked
+ * inodes waiting to be freed, and sfs_norphans. Nothing is acquired
+ * while holding it.
+ *
+ * sfs_dirtylock, a spinlock, protects the list of vnodes with dirty
+ * inodes (sfs_dirtylist and the sv_dirty* links). Nothing is acquired
+ * while holding it except vnode reference counts. A vnode is on the
+ * list exactly when sv_dirty is set; both change under sv_lock.
+ *
+ * The buffer cache's own lock is below all of these. Above them all
+ * is the VFS mount table lock (see vfslist.c), held across
+ * FSOP_SYNC, FSOP_UNMOUNT, FSOP_GETROOT and mount.
+ */
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects the above */
+	struct sfs_dirhash *sv_dirhash; /* name index (dirs only) */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	struct sfs_vnode *sv_dirtynext; /* sfs_dirtylist links */
+	struct sfs_vnode *sv_dirtyprev;
+
+	/* Block allocation state (see sfs_dalloc); under sv_lock */
+	uint32_t sv_goal;               /* where to look for next block */
+	uint32_t sv_nextfblock;         /* next file block, if sequential */
+	uint32_t sv_preall;             /* first reserved block */
+	unsigned sv_npreall;            /* number of reserved blocks */
+
+	/* Data not yet given disk blocks (see sfs_delayed_add) */
+	struct sfs_dblock *sv_delayed;  /* array, sorted by file block */
+	unsigned sv_ndelayed;           /* number in use */
+	struct sfs_ibcache *sv_ibcache; /* last indirect block used */
+
+	/* Read-ahead state (see sfs_readahead); under sv_lock */
+	uint32_t sv_ranext;             /* where a sequential read starts */
+	uint32_t sv_raend;              /* first block not read ahead */
+	unsigned sv_rawindow;           /* blocks to keep read ahead */
 };
 
+/* Number of chains in the table of loaded vnodes */
+#define SFS_VNHASHSIZE  127
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	uint32_t sfs_blocksize;         /* block size, from sfs_super */
+	unsigned sfs_blockshift;        /* log2 of sfs_blocksize */
+	uint32_t sfs_dbperidb;          /* block numbers per indirect block */
+	/* vnodes loaded into memory, hashed by inode number */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE];
+	unsigned sfs_nvnodes;           /* number of vnodes in sfs_vnhash */
+	struct lock *sfs_vnlock;        /* protects sfs_vnhash */
+	struct sfs_vnode *sfs_dirtylist; /* vnodes with sv_dirty set */
+	unsigned sfs_ndirty;            /* number of them */
+	struct spinlock sfs_dirtylock;  /* protects sfs_dirtylist */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	uint32_t sfs_nfree;             /* blocks clear in freemap */
+	uint32_t sfs_nreserved;         /* ...promised to delayed writes */
+	unsigned sfs_norphans;          /* unlinked inodes not freed yet */
+	struct lock *sfs_fslock;        /* protects freemap and superblock */
 };
 
 /*
@@ -75,17 +153,19 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+/* Convenience functions for block I/O (through the buffer cache) */
+int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block, size_t len);
+int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block, size_t len);
 
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
-int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
-int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+/* Note a change to the freemap bit for BLOCK (caller holds sfs_fslock) */
+void sfs_mapdirty(struct sfs_fs *sfs, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Freeing unlinked files in the background (see sfs_vnode.c) */
+int sfs_orphan_init(void);
+bool sfs_orphan_drain(struct sfs_fs *sfs);
+
 
 #endif /* _SFS_H_ */
@@ -37,6 +37,8 @@
 
 #include <cdefs.h>
 
+struct lockstat;	/* from <lockstat.h> */
+
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
 #define SPINLOCK_INLINE INLINE
@@ -57,12 +59,13 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+	struct lockstat *lk_stat;	/* Contention profile, or NULL. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, NULL }
 
 /*
  * Spinlock functions.
@@ -84,5 +87,12 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+/*
+ * Attach a lockstat (already registered; see lockstat.h) to a
+ * spinlock so its acquisitions are profiled. Spinlocks are not
+ * profiled by default.
+ */
+void spinlock_setstat(struct spinlock *lk, struct lockstat *ls);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -36,18 +36,24 @@
 
 
 #include <spinlock.h>
+#include <thread.h>	/* for THREAD_NPRI */
+#include <lockstat.h>
 
 /*
 * Dijkstra-style semaphore.
 *
 * The name field is for easier debugging. A copy of the name is made
 * internally.
+*
+* Every semaphore is profiled (see lockstat.h); a P that has to wait
+* counts as contended.
 */
 struct semaphore {
   char *sem_name;
   struct wchan *sem_wchan;
   struct spinlock sem_lock;
   volatile int sem_count;
+  struct lockstat sem_stat;
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -71,13 +77,37 @@ void V(struct semaphore *);
 *
 * The name field is for easier debugging. A copy of the name is
 * (should be) made internally.
+*
+* The lock is adaptive: a thread that finds the lock held by a thread
+* currently running on another CPU spins for up to LOCK_SPIN_MAX
+* iterations waiting for it to be released, on the theory that the
+* holder is about to drop it and a spin is cheaper than a context
+* switch. If the holder is not running, or the spin runs out, the
+* thread sleeps on lk_wchan as usual.
+*
+* Locks do priority inheritance. A thread that blocks on a lock lends
+* its effective priority to the holder, and on down the chain if the
+* holder is itself blocked on another lock. On release, the holder
+* drops back to the highest priority still owed to it by waiters on
+* the locks it continues to hold, and the waiter with the highest
+* priority gets the lock next.
+*
+* lk_holder, lk_nwaiters and lk_nextheld are protected by the
+* priority inheritance spinlock in synch.c, as well as by lk_splock
+* where noted there. lk_lockstat, the lock's contention profile, is
+* protected by lk_splock.
 */
+#define LOCK_SPIN_MAX 1000
+
 struct lock {
   char *lk_name;
-  char *lk_holder;
+  struct thread *lk_holder;
   struct wchan *lk_wchan;
   struct spinlock lk_splock;
   volatile bool lk_locked;
+  unsigned lk_nwaiters[THREAD_NPRI];  /* waiters at each priority */
+  struct lock *lk_nextheld;           /* holder's t_heldlocks chain */
+  struct lockstat lk_lockstat;        /* contention profile */
 };
 
 struct lock *lock_create(const char *name);
@@ -98,6 +128,17 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+* Set the base priority of the current thread. The effective priority
+* may be higher while the thread holds locks that higher priority
+* threads are waiting for.
+*
+* lock_pi_enabled turns inheritance off and on; it exists so that the
+* priority inversion test can show the difference.
+*/
+void thread_set_priority(int pri);
+extern bool lock_pi_enabled;
+
 
 /*
 * Condition variable.
@@ -138,5 +179,64 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+* Keyed variants, to avoid thundering herds on CVs shared by waiters
+* for different conditions:
+*    cv_wait_keyed      - Like cv_wait, but tag the waiter with KEY, a
+*                         bitmask of the things it is waiting for.
+*    cv_broadcast_keyed - Wake only the waiters whose key shares a bit
+*                         with KEY. Plain cv_wait waiters always match.
+*
+* See wchan.h for how keys are matched.
+*/
+void cv_wait_keyed(struct cv *cv, struct lock *lock, uint32_t key);
+void cv_broadcast_keyed(struct cv *cv, struct lock *lock, uint32_t key);
+
+
+/*
+* Reader-writer lock.
+*
+* Any number of readers may hold the lock at once; a writer holds it
+* alone. Admission prefers writers: once a writer is waiting, new
+* readers block until it has been and gone. This keeps a steady stream
+* of readers from starving writers on read-mostly structures. The
+* price is that read locks are not recursive: a thread that already
+* holds the lock for reading and asks for it again can deadlock
+* against a waiting writer.
+*
+* The name field is for easier debugging. A copy of the name is made
+* internally.
+*/
+struct rwlock {
+  char *rwlock_name;
+  struct wchan *rw_rwchan;        /* readers sleep here */
+  struct wchan *rw_wwchan;        /* writers sleep here */
+  struct spinlock rw_splock;
+  volatile unsigned rw_readers;   /* number of active readers */
+  volatile unsigned rw_waitwriters; /* number of writers waiting */
+  struct thread *rw_writer;       /* active writer, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+* Operations:
+*    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+*                           writer holds the lock or is waiting for it.
+*    rwlock_release_read  - Drop a read hold.
+*    rwlock_acquire_write - Get the lock for writing. Blocks until
+*                           there are no readers and no other writer.
+*    rwlock_release_write - Drop the write hold. Only the writer may
+*                           do this.
+*    rwlock_do_i_hold_write - Return true if the current thread holds
+*                           the lock for writing.
+*/
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
 
 #endif /* _SYNCH_H_ */
@@ -56,6 +56,18 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Thread priorities. Higher numbers are more important. The scheduler
+ * always runs the ready thread with the highest effective priority,
+ * round-robin among equals; the effective priority is the thread's own
+ * priority raised by priority inheritance from any threads waiting on
+ * locks it holds (see synch.c).
+ */
+#define THREAD_PRI_MIN		0
+#define THREAD_PRI_DEFAULT	3
+#define THREAD_PRI_MAX		7
+#define THREAD_NPRI		(THREAD_PRI_MAX + 1)
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -83,6 +95,17 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	uint32_t t_wchan_key;		/* Wakeup key, if sleeping */
+
+	/*
+	 * Priority fields. t_epriority, t_blocked_on and t_heldlocks
+	 * belong to the priority inheritance code in synch.c and are
+	 * protected by its spinlock.
+	 */
+	int t_priority;			/* Base priority */
+	volatile int t_epriority;	/* Effective (inherited) priority */
+	struct lock *t_blocked_on;	/* Lock we're waiting for, if any */
+	struct lock *t_heldlocks;	/* Locks held, via lk_nextheld */
 
 	/*
 	 * Interrupt state fields.
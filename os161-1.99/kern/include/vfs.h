@@ -185,8 +185,9 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global one-big-lock, recursive. The VFS layer and SFS have their
+ * own finer-grained locking (see vfslist.c and sfs.h); this remains
+ * only for emufs.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -30,6 +30,8 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
+
 
 struct uio;
 struct stat;
@@ -50,10 +52,18 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are protected by vn_countlock. When VOP_DECREF finds
+ * the reference count at 1, it calls VOP_RECLAIM without the lock
+ * and without decrementing; the filesystem must then recheck the
+ * count under its own vnode-table lock (someone may have looked the
+ * vnode up again in the meantime) and either destroy the vnode or
+ * consume the reference and return EBUSY.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for vn_refcount/opencount */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
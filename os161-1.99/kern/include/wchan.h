@@ -71,15 +71,33 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Keyed sleep. The key is a bitmask describing what the sleeper is
+ * waiting for; wchan_wakeall_keyed wakes only sleepers whose key
+ * shares a bit with the key it is given. Callers with more than 32
+ * distinct things to wait for can fold them with WCHAN_KEY(); the
+ * resulting false matches are harmless as long as sleepers recheck
+ * their condition after waking, as they must anyway.
+ *
+ * Plain wchan_sleep is the same as sleeping with WCHAN_KEY_ANY.
+ */
+#define WCHAN_KEY_ANY	0xffffffffU
+#define WCHAN_KEY(n)	((uint32_t)1 << ((unsigned)(n) % 32))
+
+void wchan_sleep_keyed(struct wchan *wc, uint32_t key);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
  *
  * The current implementation is FIFO but this is not promised by the
- * interface.
+ * interface. wchan_wakeone_highest wakes the sleeper with the highest
+ * effective priority instead.
  */
 void wchan_wakeone(struct wchan *wc);
+void wchan_wakeone_highest(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
+void wchan_wakeall_keyed(struct wchan *wc, uint32_t key);
 
 
 #endif /* _WCHAN_H_ */
@@ -95,31 +95,107 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first word in [from, to) that isn't full, or return TO.
+ *
+ * Runs of full words are skipped four bytes at a time. (Comparing
+ * against all-ones doesn't care about byte order.)
+ */
+static
+unsigned
+bitmap_findword(struct bitmap *b, unsigned from, unsigned to)
+{
+        unsigned ix = from;
+        uint32_t chunk;
+
+        /* Get to a 4-byte boundary */
+        while (ix < to && ix % sizeof(chunk) != 0) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
+                }
+                ix++;
+        }
+
+        /* Skip full chunks */
+        while (ix + sizeof(chunk) <= to) {
+                memcpy(&chunk, &b->v[ix], sizeof(chunk));
+                if (chunk != 0xffffffff) {
+                        break;
+                }
+                ix += sizeof(chunk);
+        }
+
+        /* The chunk with the hole in it, or the leftovers at the end */
+        while (ix < to) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
+                }
+                ix++;
+        }
+        return to;
+}
+
+/*
+ * Set and return the lowest clear bit at or above bit START of word IX.
+ * Returns ENOSPC if there isn't one.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_takebit(struct bitmap *b, unsigned ix, unsigned start,
+               unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        for (offset = start; offset < BITS_PER_WORD; offset++) {
+                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = (ix*BITS_PER_WORD)+offset;
+                        KASSERT(*index < b->nbits);
+                        return 0;
                 }
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned goalix, ix;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        goalix = goal / BITS_PER_WORD;
+
+        /* The rest of the goal's own word */
+        if (bitmap_takebit(b, goalix, goal % BITS_PER_WORD, index) == 0) {
+                return 0;
+        }
+
+        /* Then onwards to the end, then from the start back around */
+        ix = bitmap_findword(b, goalix+1, maxix);
+        if (ix == maxix) {
+                ix = bitmap_findword(b, 0, goalix+1);
+                if (ix == goalix+1) {
+                        return ENOSPC;
+                }
+        }
+
+        if (bitmap_takebit(b, ix, 0, index)) {
+                KASSERT(0);
+        }
+        return 0;
+}
+
 static
 inline
 void
@@ -157,6 +233,51 @@ bitmap_unmark(struct bitmap *b, unsigned index)
         b->v[ix] &= ~mask;
 }
 
+/*
+ * Clear the N bits from START on, which must all be set. Whole bytes
+ * in the middle of the range are cleared four at a time.
+ */
+void
+bitmap_unmarkrange(struct bitmap *b, unsigned start, unsigned n)
+{
+        unsigned end = start + n;
+        unsigned ix;
+        uint32_t chunk;
+
+        KASSERT(end >= start && end <= b->nbits);
+
+        /* Bits up to a word boundary */
+        while (start < end && start % BITS_PER_WORD != 0) {
+                bitmap_unmark(b, start);
+                start++;
+        }
+
+        /* Whole words up to a 4-byte boundary */
+        ix = start / BITS_PER_WORD;
+        while (start + BITS_PER_WORD <= end && ix % sizeof(chunk) != 0) {
+                KASSERT(b->v[ix] == WORD_ALLBITS);
+                b->v[ix] = 0;
+                ix++;
+                start += BITS_PER_WORD;
+        }
+
+        /* Whole chunks */
+        while (start + sizeof(chunk)*BITS_PER_WORD <= end) {
+                memcpy(&chunk, &b->v[ix], sizeof(chunk));
+                KASSERT(chunk == 0xffffffff);
+                chunk = 0;
+                memcpy(&b->v[ix], &chunk, sizeof(chunk));
+                ix += sizeof(chunk);
+                start += sizeof(chunk)*BITS_PER_WORD;
+        }
+
+        /* And whatever is left */
+        while (start < end) {
+                bitmap_unmark(b, start);
+                start++;
+        }
+}
+
 
 int
 bitmap_isset(struct bitmap *b, unsigned index) 
@@ -91,7 +91,7 @@ struct semaphore *no_proc_sem;
 	}
 
 	void printArr() {
-		lock_acquire(procTableLock);
+		rwlock_acquire_read(procTableLock);
 		kprintf("\t");
 		int length = array_num(processTable);
 		for (int i = 0; i < length; i++) {
@@ -103,7 +103,7 @@ struct semaphore *no_proc_sem;
 			}
 		}
 		kprintf("\n");
-		lock_release(procTableLock);
+		rwlock_release_read(procTableLock);
 	}
 #endif
 
@@ -201,10 +201,10 @@ proc_destroy(struct proc *proc)
 	DEBUG(DB_SYSCALL,"Destroy %d: Proc %d is being destroyed\n", proc->p_pid, proc->p_pid);
 
 	// Get ProcHolder for proc being deleted
-	lock_acquire(procTableLock);
+	rwlock_acquire_read(procTableLock);
 	struct ProcHolder *destProcHolder = getProcHolder(processTable, proc->p_pid);
 	KASSERT(destProcHolder != NULL);
-	lock_release(procTableLock);
+	rwlock_release_read(procTableLock);
 
 	// Remove Parent relationship from all children of calling proc
 	spinlock_acquire(&proc->p_lock);
@@ -274,7 +274,7 @@ proc_bootstrap(void)
 {
 #if OPT_A2
 	processTable = array_create();
-	procTableLock= lock_create("process_tbl_lock");
+	procTableLock = rwlock_create("process_tbl_lock");
 #endif
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
@@ -334,9 +334,9 @@ proc_create_runprogram(const char *name)
 	procHolder->p_exit_status = 0;
 	procHolder->p_proc = proc;
 	procHolder->p_canExit = false;
-	lock_acquire(procTableLock);
+	rwlock_acquire_write(procTableLock);
 	nextFreePIDSetProc(processTable, procHolder);
-	lock_release(procTableLock);
+	rwlock_release_write(procTableLock);
 #endif
 
 #ifdef UW
@@ -38,7 +38,12 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <lockstat.h>
 #include <vfs.h>
+#include <buf.h>
+#include <iosched.h>
+#include <namecache.h>
+#include <emufs.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -416,6 +421,92 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing the most contended locks.
+ */
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	int n = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: kl [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n <= 0) {
+			kprintf("Usage: kl [count]\n");
+			return EINVAL;
+		}
+	}
+
+	lockstat_dump(n);
+
+	return 0;
+}
+
+/*
+ * Command for printing buffer cache statistics.
+ */
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing name cache statistics.
+ */
+static
+int
+cmd_namestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	namecache_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing emufs statistics.
+ */
+static
+int
+cmd_emustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	emufs_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing disk queue statistics.
+ */
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	iosched_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -486,6 +577,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
+	"[sy5] Priority inversion test (1)   ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -495,6 +588,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[rawbench] Raw disk throughput [dev]",
 	NULL
 };
 
@@ -526,6 +620,11 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[kl] Kernel lock stats [n]          ",
+	"[kb] Buffer cache stats             ",
+	"[kd] Disk queue stats               ",
+	"[kn] Name cache stats               ",
+	"[ke] Emufs stats                    ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -583,6 +682,11 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kl",         cmd_lockstats },
+	{ "kb",         cmd_bufstats },
+	{ "kd",         cmd_iostats },
+	{ "kn",         cmd_namestats },
+	{ "ke",         cmd_emustats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -600,6 +704,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	pitest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -611,6 +717,7 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "rawbench",	rawbench },
 
 	{ NULL, NULL }
 };
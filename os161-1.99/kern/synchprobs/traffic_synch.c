@@ -2,6 +2,7 @@
 #include <lib.h>
 #include <synchprobs.h>
 #include <synch.h>
+#include <wchan.h>
 #include <opt-A1.h>
 
 static struct lock *intersectionLock;
@@ -14,7 +15,13 @@ static volatile int N2E, N2S, N2W;
 static volatile int E2S, E2W, E2N;
 static volatile int S2W, S2N, S2E;
 static volatile int W2N, W2E, W2S;
+// Quadrants, as wakeup keys for the destination CVs
+#define QUAD_NW 0x1
+#define QUAD_NE 0x2
+#define QUAD_SW 0x4
+#define QUAD_SE 0x8
 // Helper Functions:
+static uint32_t pathQuadrants(Direction origin, Direction destination);
 static bool blockedNW(void);
 static bool blockedNE(void);
 static bool blockedSW(void);
@@ -112,10 +119,33 @@ blockedSW(void)
   return (ret > 0);
 }
 
+/*
+Quadrants a vehicle going from origin to destination passes through.
+A waiting vehicle can only be unblocked by a vehicle leaving one of the
+quadrants it needs, so waits and wakeups are keyed by these masks.
+*/
+uint32_t
+pathQuadrants(Direction origin, Direction destination)
+{
+  static const uint32_t quads[4][4] = {
+    /* from north */
+    { 0, QUAD_NW|QUAD_SW|QUAD_SE, QUAD_NW|QUAD_SW, QUAD_NW },
+    /* from east */
+    { QUAD_NE, 0, QUAD_NE|QUAD_NW|QUAD_SW, QUAD_NE|QUAD_NW },
+    /* from south */
+    { QUAD_SE|QUAD_NE, QUAD_SE, 0, QUAD_SE|QUAD_NE|QUAD_NW },
+    /* from west */
+    { QUAD_SW|QUAD_SE|QUAD_NE, QUAD_SW|QUAD_SE, QUAD_SW, 0 },
+  };
+  return quads[origin][destination];
+}
+
 
 void
 intersection_before_entry(Direction origin, Direction destination)
 {
+  uint32_t quadrants = pathQuadrants(origin, destination);
+
   KASSERT(intersectionLock != NULL);
   lock_acquire(intersectionLock);
   if (origin == north) {
@@ -123,7 +153,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (N2S == 0) {
         KASSERT(cvDestinationSouth != NULL);
         while (blockedNW() || blockedSW()) {
-          cv_wait(cvDestinationSouth,intersectionLock);
+          cv_wait_keyed(cvDestinationSouth,intersectionLock,quadrants);
         }
       }
       N2S = N2S + 1;
@@ -131,7 +161,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (N2E == 0) {
         KASSERT(cvDestinationEast != NULL);
         while (blockedNW() || blockedSW() || blockedSE()) {
-          cv_wait(cvDestinationEast,intersectionLock);
+          cv_wait_keyed(cvDestinationEast,intersectionLock,quadrants);
         }
       }
       N2E = N2E + 1;
@@ -139,7 +169,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (N2W == 0) {
         KASSERT(cvDestinationWest != NULL);
         while (blockedNW()) {
-          cv_wait(cvDestinationWest,intersectionLock);
+          cv_wait_keyed(cvDestinationWest,intersectionLock,quadrants);
         }
       }
       N2W = N2W + 1;
@@ -149,7 +179,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (E2W == 0) {
         KASSERT(cvDestinationWest != NULL);
         while (blockedNE() || blockedNW()) {
-          cv_wait(cvDestinationWest,intersectionLock);
+          cv_wait_keyed(cvDestinationWest,intersectionLock,quadrants);
         }
       }
       E2W = E2W + 1;
@@ -157,7 +187,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (E2S == 0) {
         KASSERT(cvDestinationSouth != NULL);
         while (blockedNE() || blockedNW() || blockedSW()) {
-          cv_wait(cvDestinationWest,intersectionLock);
+          cv_wait_keyed(cvDestinationWest,intersectionLock,quadrants);
         }
       }
       E2S = E2S + 1;
@@ -165,7 +195,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (E2N == 0) {
         KASSERT(cvDestinationNorth != NULL);
         while (blockedNE()) {
-          cv_wait(cvDestinationNorth,intersectionLock);
+          cv_wait_keyed(cvDestinationNorth,intersectionLock,quadrants);
         }
       }
       E2N = E2N + 1;
@@ -175,7 +205,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (S2N == 0) {
         KASSERT(cvDestinationNorth != NULL);
         while (blockedSE() || blockedNE()) {
-          cv_wait(cvDestinationNorth,intersectionLock);
+          cv_wait_keyed(cvDestinationNorth,intersectionLock,quadrants);
         }
       }
       S2N = S2N + 1;
@@ -183,7 +213,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (S2E == 0) {
         KASSERT(cvDestinationEast != NULL);
         while (blockedSE()) {
-          cv_wait(cvDestinationEast,intersectionLock);
+          cv_wait_keyed(cvDestinationEast,intersectionLock,quadrants);
         }
       }
       S2E = S2E + 1;
@@ -191,7 +221,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (S2W == 0) {
         KASSERT(cvDestinationWest != NULL);
         while (blockedSE() || blockedNE() || blockedNW()) {
-          cv_wait(cvDestinationWest,intersectionLock);
+          cv_wait_keyed(cvDestinationWest,intersectionLock,quadrants);
         }
       }
       S2W = S2W + 1;
@@ -201,7 +231,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (W2E == 0) {
         KASSERT(cvDestinationEast != NULL);
         while (blockedSW() || blockedSE()) {
-          cv_wait(cvDestinationEast,intersectionLock);
+          cv_wait_keyed(cvDestinationEast,intersectionLock,quadrants);
         }
       }
       W2E = W2E + 1;
@@ -209,7 +239,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (W2S == 0) {
         KASSERT(cvDestinationSouth != NULL);
         while (blockedSW()) {
-          cv_wait(cvDestinationSouth,intersectionLock);
+          cv_wait_keyed(cvDestinationSouth,intersectionLock,quadrants);
         }
       }
       W2S = W2S + 1;
@@ -217,7 +247,7 @@ intersection_before_entry(Direction origin, Direction destination)
       if (W2N == 0) {
         KASSERT(cvDestinationNorth != NULL);
         while (blockedSW() || blockedSE() || blockedNE()) {
-          cv_wait(cvDestinationNorth,intersectionLock);
+          cv_wait_keyed(cvDestinationNorth,intersectionLock,quadrants);
         }
       }
       W2N = W2N + 1;
@@ -230,6 +260,8 @@ intersection_before_entry(Direction origin, Direction destination)
 void
 intersection_after_exit(Direction origin, Direction destination)
 {
+  uint32_t quadrants;
+
   KASSERT(intersectionLock != NULL);
   lock_acquire(intersectionLock);
   if (origin == north) {
@@ -265,9 +297,11 @@ intersection_after_exit(Direction origin, Direction destination)
       W2N = W2N - 1;
     }
   }
-  cv_broadcast(cvDestinationNorth,intersectionLock);
-  cv_broadcast(cvDestinationEast,intersectionLock);
-  cv_broadcast(cvDestinationSouth,intersectionLock);
-  cv_broadcast(cvDestinationWest,intersectionLock);
+  // Only wake vehicles waiting on a quadrant we just left
+  quadrants = pathQuadrants(origin, destination);
+  cv_broadcast_keyed(cvDestinationNorth,intersectionLock,quadrants);
+  cv_broadcast_keyed(cvDestinationEast,intersectionLock,quadrants);
+  cv_broadcast_keyed(cvDestinationSouth,intersectionLock,quadrants);
+  cv_broadcast_keyed(cvDestinationWest,intersectionLock,quadrants);
   lock_release(intersectionLock);
 }
@@ -17,6 +17,7 @@
 #include "opt-A2.h"
 #if OPT_A2
   #include <synch.h>
+  #include <wchan.h>
   #include <mips/trapframe.h>
 #endif
 
@@ -71,10 +72,10 @@ void sys__exit(int exitcode) {
   proc_remthread(curthread);
 
   #if OPT_A2
-  lock_acquire(procTableLock);
+  rwlock_acquire_read(procTableLock);
   struct ProcHolder *curproc_holder = NULL;
   curproc_holder = getProcHolder(processTable, p->p_pid);
-  lock_release(procTableLock);
+  rwlock_release_read(procTableLock);
   DEBUG(DB_SYSCALL,"Exit %d: Proc %d is exiting\n",p->p_pid,p->p_pid);
 
   curproc_holder->p_canExit = true;
@@ -83,7 +84,8 @@ void sys__exit(int exitcode) {
 
   if (curproc_holder->p_parent != NULL) {
     lock_acquire(curproc_holder->p_parent->p_lock_wait);
-    cv_broadcast(curproc_holder->p_parent->p_cv_wait, curproc_holder->p_parent->p_lock_wait);
+    // Only wake the parent if it is waiting for us (or something hashing the same)
+    cv_broadcast_keyed(curproc_holder->p_parent->p_cv_wait, curproc_holder->p_parent->p_lock_wait, WCHAN_KEY(p->p_pid));
     lock_release(curproc_holder->p_parent->p_lock_wait);
   }
 
@@ -133,19 +135,17 @@ sys_waitpid(pid_t pid,
 		return(EINVAL);
 	}
   // Any proc that calls waitpid should be a child proc
-  lock_acquire(procTableLock);
+  rwlock_acquire_read(procTableLock);
   struct ProcHolder *cur_proc_holder = getProcHolder(processTable, curproc->p_pid);
-  lock_release(procTableLock);
-  lock_acquire(procTableLock);
   struct ProcHolder *child_proc_holder = getProcHolder(processTable, pid);
-  lock_release(procTableLock);
+  rwlock_release_read(procTableLock);
 
   DEBUG(DB_SYSCALL,"Wait %d: Proc %d is in WaitPID\n", pid, pid);
   if (child_proc_holder->p_parent->p_pid == cur_proc_holder->p_pid) { // Calling proc is the of child of current proc
     lock_acquire(cur_proc_holder->p_lock_wait);
     while (child_proc_holder->p_canExit == false)  {
       DEBUG(DB_SYSCALL,"Wait %d: Waiting for PID %d to be exitable\n", pid, child_proc_holder->p_pid);
-      cv_wait(cur_proc_holder->p_cv_wait, cur_proc_holder->p_lock_wait);
+      cv_wait_keyed(cur_proc_holder->p_cv_wait, cur_proc_holder->p_lock_wait, WCHAN_KEY(pid));
     }
     lock_release(cur_proc_holder->p_lock_wait);
 
@@ -188,12 +188,10 @@ pid_t sys_fork(struct trapframe *tf, int *retval) {
 
   // Create Proc for Child Process
 	struct proc *fork_child = proc_create_runprogram("fork_child_proc");
-  lock_acquire(procTableLock);
+  rwlock_acquire_read(procTableLock);
   struct ProcHolder *fork_child_holder = getProcHolder(processTable, fork_child->p_pid);
-  lock_release(procTableLock);
-  lock_acquire(procTableLock);
   struct ProcHolder *curproc_holder = getProcHolder(processTable, curproc->p_pid);
-  lock_release(procTableLock);
+  rwlock_release_read(procTableLock);
 
   DEBUG(DB_SYSCALL,"Fork %d: Cur Proc %d if being forked to create child %d\n", curproc->p_pid, curproc->p_pid, fork_child->p_pid);
 
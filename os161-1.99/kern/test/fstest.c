@@ -48,6 +48,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <clock.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -577,6 +578,171 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
 
+////////////////////////////////////////////////////////////
+//
+// Raw disk throughput
+
+#define RAWBENCH_DEFDEV   "lhd0raw:"
+#define RAWBENCH_BYTES    (256*1024)	/* read this much per run */
+#define RAWBENCH_MAXCHUNK 16384
+#define RAWBENCH_NTHREADS 4
+#define RAWBENCH_TCHUNK   4096		/* per-thread chunk */
+
+static char rawbench_dev[32];
+
+/*
+ * Read LEN bytes starting at POS, CHUNK bytes at a time, skipping
+ * STRIDE bytes after each chunk. Returns 0 or an error.
+ */
+static
+int
+rawbench_read(const char *dev, char *buf, size_t chunk, off_t pos,
+	      off_t stride, size_t len)
+{
+	char path[sizeof(rawbench_dev)];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	size_t done;
+	int result;
+
+	/* vfs_open destroys the string it's passed; make a copy */
+	strcpy(path, dev);
+	result = vfs_open(path, O_RDONLY, 0, &vn);
+	if (result) {
+		return result;
+	}
+
+	for (done = 0; done < len; done += chunk) {
+		uio_kinit(&iov, &ku, buf, chunk, pos, UIO_READ);
+		result = VOP_READ(vn, &ku);
+		if (result) {
+			break;
+		}
+		if (ku.uio_resid > 0) {
+			result = EIO;
+			break;
+		}
+		pos += chunk + stride;
+	}
+
+	vfs_close(vn);
+	return result;
+}
+
+/*
+ * Print LEN bytes in the time since SECS/NSECS as KB/s.
+ */
+static
+void
+rawbench_report(const char *what, size_t len, time_t secs, uint32_t nsecs)
+{
+	time_t secs2, dsecs;
+	uint32_t nsecs2, dnsecs, usecs;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs, nsecs, secs2, nsecs2, &dsecs, &dnsecs);
+	usecs = dsecs*1000000 + dnsecs/1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("rawbench: %-24s %6u KB in %3lu.%06lu s: %6u KB/s\n", what,
+		len/1024, (unsigned long)dsecs, (unsigned long)dnsecs/1000,
+		(len/1024) * 1000000 / usecs);
+}
+
+static
+void
+rawbench_thread(void *buf, unsigned long num)
+{
+	int result;
+
+	/*
+	 * Thread NUM reads chunks NUM, NUM+NTHREADS, ..., so at any
+	 * moment the threads' requests are next to each other on disk.
+	 */
+	result = rawbench_read(rawbench_dev, buf, RAWBENCH_TCHUNK,
+			       num * RAWBENCH_TCHUNK,
+			       (RAWBENCH_NTHREADS-1) * RAWBENCH_TCHUNK,
+			       RAWBENCH_BYTES / RAWBENCH_NTHREADS);
+	if (result) {
+		kprintf("rawbench: thread %lu: %s\n", num, strerror(result));
+	}
+	kfree(buf);
+	V(threadsem);
+}
+
+/*
+ * Measure read throughput of a raw disk device, first with one thread
+ * and various request sizes, then with several threads reading
+ * interleaved chunks. Reads only; safe to run on a mounted disk.
+ */
+int
+rawbench(int nargs, char **args)
+{
+	static const size_t chunks[] = { 512, 4096, RAWBENCH_MAXCHUNK };
+	char what[32];
+	char *buf;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: rawbench [device]\n");
+		return EINVAL;
+	}
+	if (strlen(nargs == 2 ? args[1] : RAWBENCH_DEFDEV) + 1 
+	    > sizeof(rawbench_dev)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(rawbench_dev, nargs == 2 ? args[1] : RAWBENCH_DEFDEV);
+
+	init_threadsem();
+
+	buf = kmalloc(RAWBENCH_MAXCHUNK);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<sizeof(chunks)/sizeof(chunks[0]); i++) {
+		gettime(&secs, &nsecs);
+		result = rawbench_read(rawbench_dev, buf, chunks[i], 0, 0,
+				       RAWBENCH_BYTES);
+		if (result) {
+			kprintf("rawbench: %s: %s\n", rawbench_dev,
+				strerror(result));
+			kfree(buf);
+			return result;
+		}
+		snprintf(what, sizeof(what), "1 thread, %u-byte reads",
+			 chunks[i]);
+		rawbench_report(what, RAWBENCH_BYTES, secs, nsecs);
+	}
+	kfree(buf);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<RAWBENCH_NTHREADS; i++) {
+		buf = kmalloc(RAWBENCH_TCHUNK);
+		if (buf == NULL) {
+			panic("rawbench: Out of memory\n");
+		}
+		result = thread_fork("rawbench", NULL, rawbench_thread, buf, i);
+		if (result) {
+			panic("rawbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<RAWBENCH_NTHREADS; i++) {
+		P(threadsem);
+	}
+	snprintf(what, sizeof(what), "%d threads, %d-byte reads",
+		 RAWBENCH_NTHREADS, RAWBENCH_TCHUNK);
+	rawbench_report(what, RAWBENCH_BYTES, secs, nsecs);
+
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 int
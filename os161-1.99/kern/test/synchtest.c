@@ -35,12 +35,15 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <current.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +350,339 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock stress test. One thread in four is a writer;
+ * the rest read. Writers update testval1..3 in a way readers can
+ * check for consistency, and everyone counts who is inside the
+ * lock (under a spinlock, so the counting itself is not subject to
+ * the lock being tested) to catch readers and writers overlapping.
+ */
+
+static struct rwlock *testrw;
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rw_readers_in;
+static volatile unsigned rw_writers_in;
+static volatile unsigned rw_max_readers;
+static volatile bool rw_failed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rw_failed = true;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned long v;
+	bool bad;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			spinlock_acquire(&rwcount_lock);
+			rw_writers_in++;
+			bad = (rw_writers_in != 1 || rw_readers_in != 0);
+			spinlock_release(&rwcount_lock);
+			if (bad) {
+				rwfail(num, "writer not alone in rwlock");
+			}
+
+			testval1 = num + i;
+			for (j=0; j<100; j++);
+			testval2 = testval1 * testval1;
+			testval3 = testval1 % 3;
+
+			spinlock_acquire(&rwcount_lock);
+			rw_writers_in--;
+			spinlock_release(&rwcount_lock);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwcount_lock);
+			rw_readers_in++;
+			bad = (rw_writers_in != 0);
+			if (rw_readers_in > rw_max_readers) {
+				rw_max_readers = rw_readers_in;
+			}
+			spinlock_release(&rwcount_lock);
+			if (bad) {
+				rwfail(num, "reader overlapped a writer");
+			}
+
+			v = testval1;
+			for (j=0; j<100; j++);
+			if (testval2 != v*v || testval3 != v%3) {
+				rwfail(num, "inconsistent values under read lock");
+			}
+
+			spinlock_acquire(&rwcount_lock);
+			rw_readers_in--;
+			spinlock_release(&rwcount_lock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+	rw_readers_in = rw_writers_in = rw_max_readers = 0;
+	rw_failed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Most concurrent readers: %u\n", rw_max_readers);
+	kprintf(rw_failed ? "Test failed\n" : "Test succeeded\n");
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("RW lock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Priority inversion test. A low priority thread takes a lock; a high
+ * priority thread then blocks on it, while several medium priority
+ * threads burn CPU.
+ *
+ * What's checked is the holder's effective priority while the high
+ * priority thread is blocked: with inheritance it must have been
+ * raised to THREAD_PRI_MAX, without it must still be THREAD_PRI_MIN,
+ * and once the holder lets go it must be back to its own.
+ *
+ * The test also shows what difference that makes, by counting the
+ * medium threads that finish before the high priority thread gets
+ * the lock. On a single CPU, without inheritance the medium threads
+ * starve the holder, so that's all of them (the inversion); with it,
+ * none. With more CPUs the holder can simply run on a CPU the medium
+ * threads aren't using, so the counts are only printed.
+ *
+ * The test runs both ways, toggling lock_pi_enabled.
+ */
+
+#define NPIMEDIUM     4
+#define NPIWORK       50
+#define NPISPIN       200
+
+static struct lock *pilock;
+static struct semaphore *piheld;
+static struct semaphore *pigo;
+static struct thread *volatile pilow;
+static struct thread *volatile pihigh;
+static volatile int pi_low_released;
+static volatile unsigned pi_medium_done;
+static volatile unsigned pi_medium_done_at_acquire;
+static bool pi_failed;
+
+static
+void
+pilowthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+	(void)num;
+
+	thread_set_priority(THREAD_PRI_MIN);
+	lock_acquire(pilock);
+	pilow = curthread;
+	V(piheld);
+	/* hold the lock until the high priority thread is waiting */
+	P(pigo);
+	for (i=0; i<NPIWORK; i++) {
+		thread_yield();
+	}
+	lock_release(pilock);
+	pi_low_released = curthread->t_epriority;
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+void
+pimediumthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+	(void)num;
+
+	thread_set_priority(THREAD_PRI_DEFAULT + 1);
+	for (i=0; i<NPISPIN; i++) {
+		thread_yield();
+	}
+	pi_medium_done++;
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+void
+pihighthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	thread_set_priority(THREAD_PRI_MAX);
+	pihigh = curthread;
+	lock_acquire(pilock);
+	pi_medium_done_at_acquire = pi_medium_done;
+	lock_release(pilock);
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+/*
+ * Run the test once; returns how many medium threads finished before
+ * the high priority thread got the lock.
+ */
+static
+unsigned
+pirun(bool inherit)
+{
+	int i, result, expect, epri;
+
+	lock_pi_enabled = inherit;
+	pilow = pihigh = NULL;
+	pi_low_released = -1;
+	pi_medium_done = 0;
+	pi_medium_done_at_acquire = 0;
+
+	result = thread_fork("pitest-low", NULL, pilowthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	/* wait until the low priority thread has the lock */
+	P(piheld);
+
+	result = thread_fork("pitest-high", NULL, pihighthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	/* wait until it's blocked on the lock */
+	while (pihigh == NULL || pihigh->t_blocked_on != pilock) {
+		thread_yield();
+	}
+
+	/* The holder is waiting on pigo, so this can't change yet */
+	epri = pilow->t_epriority;
+	expect = inherit ? THREAD_PRI_MAX : THREAD_PRI_MIN;
+	kprintf("Inheritance %s: holder's priority is %d while the high "
+		"priority thread waits (should be %d)\n",
+		inherit ? "on " : "off", epri, expect);
+	if (epri != expect) {
+		pi_failed = true;
+	}
+
+	for (i=0; i<NPIMEDIUM; i++) {
+		result = thread_fork("pitest-medium", NULL, pimediumthread,
+				     NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	V(pigo);
+	for (i=0; i<NPIMEDIUM+2; i++) {
+		P(donesem);
+	}
+
+	if (pi_low_released != THREAD_PRI_MIN) {
+		kprintf("Inheritance %s: holder's priority is %d after "
+			"releasing (should be %d)\n", inherit ? "on " : "off",
+			pi_low_released, THREAD_PRI_MIN);
+		pi_failed = true;
+	}
+	kprintf("Inheritance %s: high priority thread got the lock after "
+		"%u of %d medium threads finished\n",
+		inherit ? "on " : "off", pi_medium_done_at_acquire,
+		NPIMEDIUM);
+	return pi_medium_done_at_acquire;
+}
+
+int
+pitest(int nargs, char **args)
+{
+	bool saved;
+	unsigned off, on;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting priority inversion test...\n");
+
+	pilock = lock_create("pilock");
+	piheld = sem_create("piheld", 0);
+	pigo = sem_create("pigo", 0);
+	if (pilock == NULL || piheld == NULL || pigo == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	pi_failed = false;
+	saved = lock_pi_enabled;
+	off = pirun(false);
+	on = pirun(true);
+	lock_pi_enabled = saved;
+
+	kprintf("Medium threads finished before the high priority thread "
+		"got the lock: %u without inheritance, %u with it\n", off, on);
+	kprintf(pi_failed ? "Test failed\n" : "Test succeeded\n");
+
+	sem_destroy(pigo);
+	sem_destroy(piheld);
+	lock_destroy(pilock);
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Priority inversion test done.\n");
+
+	return 0;
+}
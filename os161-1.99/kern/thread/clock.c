@@ -58,6 +58,12 @@
  */
 static struct wchan *lbolt;
 
+/*
+ * Global tick count. Only CPU 0 advances it, so there's no need to
+ * lock it.
+ */
+volatile uint32_t hardclock_ticks;
+
 /*
  * Setup.
  */
@@ -93,6 +99,9 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if (curcpu->c_number == 0) {
+		hardclock_ticks++;
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
@@ -0,0 +1,151 @@
+/*
+ * Lock contention profiling. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+/* Registry of all profiled locks, and its (unprofiled) spinlock. */
+static struct lockstat *lockstat_list = NULL;
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+lockstat_zero(struct lockstat *ls)
+{
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_waitticks = 0;
+	ls->ls_maxhold = 0;
+}
+
+void
+lockstat_register(struct lockstat *ls, const char *name)
+{
+	snprintf(ls->ls_name, sizeof(ls->ls_name), "%s", name);
+	lockstat_zero(ls);
+	ls->ls_heldsince = 0;
+
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_prev = NULL;
+	ls->ls_next = lockstat_list;
+	if (lockstat_list != NULL) {
+		lockstat_list->ls_prev = ls;
+	}
+	lockstat_list = ls;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_unregister(struct lockstat *ls)
+{
+	spinlock_acquire(&lockstat_lock);
+	if (ls->ls_prev != NULL) {
+		ls->ls_prev->ls_next = ls->ls_next;
+	}
+	else {
+		KASSERT(lockstat_list == ls);
+		lockstat_list = ls->ls_next;
+	}
+	if (ls->ls_next != NULL) {
+		ls->ls_next->ls_prev = ls->ls_prev;
+	}
+	ls->ls_prev = ls->ls_next = NULL;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool contended, uint32_t started)
+{
+	uint32_t now = hardclock_ticks;
+
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_waitticks += now - started;
+	}
+	ls->ls_heldsince = now;
+}
+
+void
+lockstat_released(struct lockstat *ls)
+{
+	uint32_t held = hardclock_ticks - ls->ls_heldsince;
+
+	if (held > ls->ls_maxhold) {
+		ls->ls_maxhold = held;
+	}
+}
+
+/*
+ * Print the N most contended locks and reset everything.
+ *
+ * The entries are copied out while holding the registry lock, so
+ * that locks destroyed while we print don't matter; the array to copy
+ * into is allocated beforehand, because kmalloc takes a spinlock that
+ * might be profiled.
+ */
+void
+lockstat_dump(unsigned n)
+{
+	struct lockstat *top, *ls;
+	unsigned ntop, i, j, total;
+
+	if (n == 0) {
+		return;
+	}
+	top = kmalloc(n * sizeof(*top));
+	if (top == NULL) {
+		kprintf("lockstat: out of memory\n");
+		return;
+	}
+
+	ntop = 0;
+	total = 0;
+	spinlock_acquire(&lockstat_lock);
+	for (ls = lockstat_list; ls != NULL; ls = ls->ls_next) {
+		total++;
+		if (ls->ls_contended == 0 && ls->ls_acquires == 0) {
+			continue;
+		}
+		/* insertion into the sorted top-N array */
+		for (i = ntop; i > 0; i--) {
+			if (top[i-1].ls_contended > ls->ls_contended ||
+			    (top[i-1].ls_contended == ls->ls_contended &&
+			     top[i-1].ls_acquires >= ls->ls_acquires)) {
+				break;
+			}
+		}
+		if (i >= n) {
+			continue;
+		}
+		j = (ntop < n) ? ntop : n - 1;
+		for (; j > i; j--) {
+			top[j] = top[j-1];
+		}
+		top[i] = *ls;
+		if (ntop < n) {
+			ntop++;
+		}
+	}
+	for (ls = lockstat_list; ls != NULL; ls = ls->ls_next) {
+		lockstat_zero(ls);
+	}
+	spinlock_release(&lockstat_lock);
+
+	kprintf("%u locks registered; %u most contended:\n", total, ntop);
+	kprintf("%-24s %10s %10s %10s %8s\n",
+		"name", "acquires", "contended", "waitticks", "maxhold");
+	for (i = 0; i < ntop; i++) {
+		kprintf("%-24s %10u %10u %10u %8u\n",
+			top[i].ls_name, top[i].ls_acquires,
+			top[i].ls_contended, (unsigned)top[i].ls_waitticks,
+			(unsigned)top[i].ls_maxhold);
+	}
+	kprintf("Counters reset.\n");
+
+	kfree(top);
+}
@@ -35,6 +35,8 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
 #include <current.h>	/* for curcpu */
 
 /*
@@ -50,6 +52,7 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+	lk->lk_stat = NULL;
 }
 
 /*
@@ -73,6 +76,8 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	bool contended = false;
+	uint32_t started = hardclock_ticks;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -99,15 +104,20 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		break;
 	}
 
 	lk->lk_holder = mycpu;
+	if (lk->lk_stat != NULL) {
+		lockstat_acquired(lk->lk_stat, contended, started);
+	}
 }
 
 /*
@@ -121,11 +131,23 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	if (lk->lk_stat != NULL) {
+		lockstat_released(lk->lk_stat);
+	}
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
+/*
+ * Start profiling a spinlock.
+ */
+void
+spinlock_setstat(struct spinlock *lk, struct lockstat *ls)
+{
+	lk->lk_stat = ls;
+}
+
 /*
  * Check if the current cpu holds the lock.
  */ 
@@ -34,7 +34,9 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <spinlock.h>
+#include <clock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
@@ -71,6 +73,7 @@ sem_create(const char *name, int initial_count)
 
   spinlock_init(&sem->sem_lock);
   sem->sem_count = initial_count;
+  lockstat_register(&sem->sem_stat, name);
 
   return sem;
 }
@@ -81,6 +84,7 @@ sem_destroy(struct semaphore *sem)
   KASSERT(sem != NULL);
 
   /* wchan_cleanup will assert if anyone's waiting on it */
+  lockstat_unregister(&sem->sem_stat);
   spinlock_cleanup(&sem->sem_lock);
   wchan_destroy(sem->sem_wchan);
   kfree(sem->sem_name);
@@ -90,6 +94,9 @@ sem_destroy(struct semaphore *sem)
 void
 P(struct semaphore *sem)
 {
+  uint32_t started;
+  bool contended;
+
   KASSERT(sem != NULL);
 
   /*
@@ -101,6 +108,8 @@ P(struct semaphore *sem)
   KASSERT(curthread->t_in_interrupt == false);
 
   spinlock_acquire(&sem->sem_lock);
+  started = hardclock_ticks;
+  contended = (sem->sem_count == 0);
   while (sem->sem_count == 0) {
     /*
     * Bridge to the wchan lock, so if someone else comes
@@ -126,6 +135,8 @@ P(struct semaphore *sem)
   }
   KASSERT(sem->sem_count > 0);
   sem->sem_count--;
+  /* semaphores have no holder, so there's no hold time to record */
+  lockstat_acquired(&sem->sem_stat, contended, started);
   spinlock_release(&sem->sem_lock);
 }
 
@@ -147,10 +158,114 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+* Priority inheritance state: lk_holder, lk_nwaiters and lk_nextheld
+* in every lock, and t_epriority, t_blocked_on and t_heldlocks in
+* every thread. One global spinlock covers all of it, because pushing
+* a priority down a chain of blocked threads touches several locks and
+* threads at once. When also taking a lock's lk_splock, take that
+* first.
+*/
+static struct spinlock lock_pi_splock = SPINLOCK_INITIALIZER;
+bool lock_pi_enabled = true;
+
+/*
+* Highest priority of any thread waiting for LOCK, or -1 if none.
+*/
+static
+int
+lock_pi_maxwaiter(struct lock *lock)
+{
+  int pri;
+
+  for (pri = THREAD_PRI_MAX; pri >= THREAD_PRI_MIN; pri--) {
+    if (lock->lk_nwaiters[pri] > 0) {
+      return pri;
+    }
+  }
+  return -1;
+}
+
+/*
+* Recompute T's effective priority from its base priority and the
+* waiters on the locks it holds.
+*/
+static
+void
+lock_pi_recompute(struct thread *t)
+{
+  struct lock *l;
+  int pri, wpri;
+
+  KASSERT(spinlock_do_i_hold(&lock_pi_splock));
+
+  pri = t->t_priority;
+  if (lock_pi_enabled) {
+    for (l = t->t_heldlocks; l != NULL; l = l->lk_nextheld) {
+      wpri = lock_pi_maxwaiter(l);
+      if (wpri > pri) {
+        pri = wpri;
+      }
+    }
+  }
+  t->t_epriority = pri;
+}
+
+/*
+* Lend T's effective priority to the holder of the lock T is blocked
+* on, and so on down the chain until we reach a thread that already
+* runs at least that high or one that isn't blocked. A blocked thread
+* is counted in lk_nwaiters at its effective priority, so moving its
+* priority also means moving its count.
+*/
+static
+void
+lock_pi_propagate(struct thread *t)
+{
+  struct lock *l;
+  struct thread *holder;
+  int pri;
+
+  KASSERT(spinlock_do_i_hold(&lock_pi_splock));
+
+  if (!lock_pi_enabled) {
+    return;
+  }
+
+  pri = t->t_epriority;
+  for (l = t->t_blocked_on; l != NULL; l = holder->t_blocked_on) {
+    holder = l->lk_holder;
+    if (holder == NULL || holder->t_epriority >= pri) {
+      break;
+    }
+    if (holder->t_blocked_on != NULL) {
+      KASSERT(holder->t_blocked_on->lk_nwaiters[holder->t_epriority] > 0);
+      holder->t_blocked_on->lk_nwaiters[holder->t_epriority]--;
+      holder->t_blocked_on->lk_nwaiters[pri]++;
+    }
+    holder->t_epriority = pri;
+  }
+}
+
+void
+thread_set_priority(int pri)
+{
+  KASSERT(pri >= THREAD_PRI_MIN && pri <= THREAD_PRI_MAX);
+
+  spinlock_acquire(&lock_pi_splock);
+  curthread->t_priority = pri;
+  lock_pi_recompute(curthread);
+  spinlock_release(&lock_pi_splock);
+
+  /* give anything that now outranks us a chance to run */
+  thread_yield();
+}
+
 struct lock *
 lock_create(const char *name)
 {
   struct lock *lock;
+  int i;
 
   lock = kmalloc(sizeof(struct lock));
   if (lock == NULL) {
@@ -173,6 +288,11 @@ lock_create(const char *name)
   spinlock_init(&lock->lk_splock);
   lock->lk_locked = false;
   lock->lk_holder = NULL;
+  for (i = 0; i < THREAD_NPRI; i++) {
+    lock->lk_nwaiters[i] = 0;
+  }
+  lock->lk_nextheld = NULL;
+  lockstat_register(&lock->lk_lockstat, name);
 
   return lock;
 }
@@ -182,7 +302,9 @@ lock_destroy(struct lock *lock)
 {
   KASSERT(lock != NULL);
   KASSERT(lock->lk_locked == false);
+  KASSERT(lock_pi_maxwaiter(lock) < 0);
 
+  lockstat_unregister(&lock->lk_lockstat);
   spinlock_cleanup(&lock->lk_splock);
   wchan_destroy(lock->lk_wchan);
 
@@ -190,23 +312,91 @@ lock_destroy(struct lock *lock)
   kfree(lock);
 }
 
+/*
+* Check if the holder of the lock is running on some other cpu. Must be
+* called with lk_splock held; this keeps the holder from releasing the
+* lock (and possibly exiting) while we look at it.
+*
+* The state check is unlocked and therefore only a hint; that's fine,
+* because all it decides is whether we spin a little before sleeping.
+*/
+static
+bool
+lock_holder_oncpu(struct lock *lock)
+{
+  struct thread *holder;
+
+  KASSERT(spinlock_do_i_hold(&lock->lk_splock));
+
+  holder = lock->lk_holder;
+  if (holder == NULL) {
+    return false;
+  }
+  return (holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self);
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+  unsigned spins;
+  uint32_t started;
+  bool contended;
+
   KASSERT(lock != NULL);
   KASSERT(curthread->t_in_interrupt == false);
+  KASSERT(!lock_do_i_hold(lock));
 
   spinlock_acquire(&lock->lk_splock);
+  started = hardclock_ticks;
+  contended = lock->lk_locked;
 
+  spins = 0;
   while (lock->lk_locked) {
+    if (spins < LOCK_SPIN_MAX && lock_holder_oncpu(lock)) {
+      /*
+      * The holder is running elsewhere and will probably
+      * release soon. Spin on lk_locked with the spinlock
+      * dropped, so the holder can get in to release it.
+      */
+      spinlock_release(&lock->lk_splock);
+      while (lock->lk_locked && spins < LOCK_SPIN_MAX) {
+        spins++;
+      }
+      spinlock_acquire(&lock->lk_splock);
+      continue;
+    }
+
+    /* Register as a waiter and lend the holder our priority. */
+    spinlock_acquire(&lock_pi_splock);
+    curthread->t_blocked_on = lock;
+    lock->lk_nwaiters[curthread->t_epriority]++;
+    lock_pi_propagate(curthread);
+    spinlock_release(&lock_pi_splock);
+
     wchan_lock(lock->lk_wchan);
     spinlock_release(&lock->lk_splock);
     wchan_sleep(lock->lk_wchan);
     spinlock_acquire(&lock->lk_splock);
+    spins = 0;
+
+    spinlock_acquire(&lock_pi_splock);
+    KASSERT(curthread->t_blocked_on == lock);
+    KASSERT(lock->lk_nwaiters[curthread->t_epriority] > 0);
+    lock->lk_nwaiters[curthread->t_epriority]--;
+    curthread->t_blocked_on = NULL;
+    spinlock_release(&lock_pi_splock);
   }
 
   lock->lk_locked = true;
-  lock->lk_holder = curthread->t_name;
+  lockstat_acquired(&lock->lk_lockstat, contended, started);
+
+  spinlock_acquire(&lock_pi_splock);
+  lock->lk_holder = curthread;
+  lock->lk_nextheld = curthread->t_heldlocks;
+  curthread->t_heldlocks = lock;
+  /* anyone still waiting is now waiting on us */
+  lock_pi_recompute(curthread);
+  spinlock_release(&lock_pi_splock);
 
   spinlock_release(&lock->lk_splock);
 }
@@ -214,15 +404,28 @@ lock_acquire(struct lock *lock)
 void
 lock_release(struct lock *lock)
 {
+  struct lock **lp;
+
   KASSERT(lock != NULL);
   KASSERT(lock_do_i_hold(lock));
 
   spinlock_acquire(&lock->lk_splock);
 
+  lockstat_released(&lock->lk_lockstat);
   lock->lk_locked = false;
+
+  /* Unlink from our held locks and give back what was lent for it. */
+  spinlock_acquire(&lock_pi_splock);
+  for (lp = &curthread->t_heldlocks; *lp != lock; lp = &(*lp)->lk_nextheld) {
+    KASSERT(*lp != NULL);
+  }
+  *lp = lock->lk_nextheld;
+  lock->lk_nextheld = NULL;
   lock->lk_holder = NULL;
+  lock_pi_recompute(curthread);
+  spinlock_release(&lock_pi_splock);
 
-  wchan_wakeone(lock->lk_wchan);
+  wchan_wakeone_highest(lock->lk_wchan);
 
   spinlock_release(&lock->lk_splock);
 }
@@ -231,7 +434,7 @@ bool
 lock_do_i_hold(struct lock *lock)
 {
   KASSERT(lock != NULL);
-  return (curthread->t_name == lock->lk_holder);
+  return (lock->lk_holder == curthread);
 }
 
 ////////////////////////////////////////////////////////////
@@ -303,3 +506,161 @@ cv_broadcast(struct cv *cv, struct lock *lock)
   KASSERT(lock_do_i_hold(lock));
   wchan_wakeall(cv->cv_wchan);
 }
+
+void
+cv_wait_keyed(struct cv *cv, struct lock *lock, uint32_t key)
+{
+  KASSERT(lock_do_i_hold(lock));
+  wchan_lock(cv->cv_wchan);
+  lock_release(lock);
+  wchan_sleep_keyed(cv->cv_wchan, key);
+  lock_acquire(lock);
+}
+
+void
+cv_broadcast_keyed(struct cv *cv, struct lock *lock, uint32_t key)
+{
+  KASSERT(lock_do_i_hold(lock));
+  wchan_wakeall_keyed(cv->cv_wchan, key);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+  struct rwlock *rw;
+
+  rw = kmalloc(sizeof(struct rwlock));
+  if (rw == NULL) {
+    return NULL;
+  }
+
+  rw->rwlock_name = kstrdup(name);
+  if (rw->rwlock_name == NULL) {
+    kfree(rw);
+    return NULL;
+  }
+
+  rw->rw_rwchan = wchan_create(rw->rwlock_name);
+  if (rw->rw_rwchan == NULL) {
+    kfree(rw->rwlock_name);
+    kfree(rw);
+    return NULL;
+  }
+
+  rw->rw_wwchan = wchan_create(rw->rwlock_name);
+  if (rw->rw_wwchan == NULL) {
+    wchan_destroy(rw->rw_rwchan);
+    kfree(rw->rwlock_name);
+    kfree(rw);
+    return NULL;
+  }
+
+  spinlock_init(&rw->rw_splock);
+  rw->rw_readers = 0;
+  rw->rw_waitwriters = 0;
+  rw->rw_writer = NULL;
+
+  return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+  KASSERT(rw->rw_readers == 0);
+  KASSERT(rw->rw_waitwriters == 0);
+  KASSERT(rw->rw_writer == NULL);
+
+  spinlock_cleanup(&rw->rw_splock);
+  wchan_destroy(rw->rw_wwchan);
+  wchan_destroy(rw->rw_rwchan);
+
+  kfree(rw->rwlock_name);
+  kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+  KASSERT(curthread->t_in_interrupt == false);
+  KASSERT(rw->rw_writer != curthread);
+
+  spinlock_acquire(&rw->rw_splock);
+  while (rw->rw_writer != NULL || rw->rw_waitwriters > 0) {
+    wchan_lock(rw->rw_rwchan);
+    spinlock_release(&rw->rw_splock);
+    wchan_sleep(rw->rw_rwchan);
+    spinlock_acquire(&rw->rw_splock);
+  }
+  rw->rw_readers++;
+  spinlock_release(&rw->rw_splock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+
+  spinlock_acquire(&rw->rw_splock);
+  KASSERT(rw->rw_writer == NULL);
+  KASSERT(rw->rw_readers > 0);
+  rw->rw_readers--;
+  if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+    wchan_wakeone(rw->rw_wwchan);
+  }
+  spinlock_release(&rw->rw_splock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+  KASSERT(curthread->t_in_interrupt == false);
+  KASSERT(rw->rw_writer != curthread);
+
+  spinlock_acquire(&rw->rw_splock);
+  rw->rw_waitwriters++;
+  while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+    wchan_lock(rw->rw_wwchan);
+    spinlock_release(&rw->rw_splock);
+    wchan_sleep(rw->rw_wwchan);
+    spinlock_acquire(&rw->rw_splock);
+  }
+  rw->rw_waitwriters--;
+  rw->rw_writer = curthread;
+  spinlock_release(&rw->rw_splock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+  KASSERT(rwlock_do_i_hold_write(rw));
+
+  spinlock_acquire(&rw->rw_splock);
+  KASSERT(rw->rw_readers == 0);
+  rw->rw_writer = NULL;
+  /*
+  * Hand off to the next writer if there is one; otherwise let
+  * in everyone who queued up to read while we held the lock.
+  */
+  if (rw->rw_waitwriters > 0) {
+    wchan_wakeone(rw->rw_wwchan);
+  }
+  else {
+    wchan_wakeall(rw->rw_rwchan);
+  }
+  spinlock_release(&rw->rw_splock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+  KASSERT(rw != NULL);
+  return (rw->rw_writer == curthread);
+}
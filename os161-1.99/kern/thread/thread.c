@@ -143,6 +143,11 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_wchan_key = WCHAN_KEY_ANY;
+	thread->t_priority = THREAD_PRI_DEFAULT;
+	thread->t_epriority = THREAD_PRI_DEFAULT;
+	thread->t_blocked_on = NULL;
+	thread->t_heldlocks = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -194,6 +199,11 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	/* The run queue locks are the spinlocks most worth watching. */
+	snprintf(namebuf, sizeof(namebuf), "runqueue #%u", c->c_number);
+	lockstat_register(&c->c_runqueue_stat, namebuf);
+	spinlock_setstat(&c->c_runqueue_lock, &c->c_runqueue_stat);
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -506,6 +516,8 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = curthread->t_priority;
+	newthread->t_epriority = curthread->t_priority;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -534,6 +546,30 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Take the thread with the highest effective priority off a run
+ * queue. Among threads of equal priority, take the one nearest the
+ * head, so equal-priority threads run round-robin. Returns NULL if
+ * the queue is empty.
+ */
+static
+struct thread *
+thread_pick_next(struct threadlist *tl)
+{
+	struct thread *t, *best;
+
+	best = NULL;
+	THREADLIST_FORALL(t, *tl) {
+		if (best == NULL || t->t_epriority > best->t_epriority) {
+			best = t;
+		}
+	}
+	if (best != NULL) {
+		threadlist_remove(tl, best);
+	}
+	return best;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -632,7 +668,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = thread_pick_next(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
@@ -1021,10 +1057,23 @@ wchan_unlock(struct wchan *wc)
  */
 void
 wchan_sleep(struct wchan *wc)
+{
+	wchan_sleep_keyed(wc, WCHAN_KEY_ANY);
+}
+
+/*
+ * Like wchan_sleep, but tag the sleeping thread with KEY so that
+ * wchan_wakeall_keyed can pass it over if the wakeup is of no
+ * interest to it.
+ */
+void
+wchan_sleep_keyed(struct wchan *wc, uint32_t key)
 {
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(key != 0);
 
+	curthread->t_wchan_key = key;
 	thread_switch(S_SLEEP, wc);
 }
 
@@ -1053,6 +1102,26 @@ wchan_wakeone(struct wchan *wc)
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Wake up the thread sleeping on a wait channel that has the highest
+ * effective priority; the longest-sleeping one among equals.
+ */
+void
+wchan_wakeone_highest(struct wchan *wc)
+{
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	target = thread_pick_next(&wc->wc_threads);
+	spinlock_release(&wc->wc_lock);
+
+	if (target == NULL) {
+		return;
+	}
+
+	thread_make_runnable(target, false);
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
@@ -1090,6 +1159,45 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up all threads sleeping on a wait channel whose key shares at
+ * least one bit with KEY. Threads that slept with plain wchan_sleep
+ * have WCHAN_KEY_ANY and so are always woken.
+ */
+void
+wchan_wakeall_keyed(struct wchan *wc, uint32_t key)
+{
+	struct threadlistnode *tln, *next;
+	struct thread *target;
+	struct threadlist list;
+
+	threadlist_init(&list);
+
+	/*
+	 * Lock the channel and move the matching threads to a private
+	 * list. Walk by node rather than with THREADLIST_FORALL, since
+	 * we're removing things as we go.
+	 */
+	spinlock_acquire(&wc->wc_lock);
+	tln = wc->wc_threads.tl_head.tln_next;
+	while (tln->tln_next != NULL) {
+		next = tln->tln_next;
+		target = tln->tln_self;
+		if (target->t_wchan_key & key) {
+			threadlist_remove(&wc->wc_threads, target);
+			threadlist_addtail(&list, target);
+		}
+		tln = next;
+	}
+	spinlock_release(&wc->wc_lock);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_make_runnable(target, false);
+	}
+
+	threadlist_cleanup(&list);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
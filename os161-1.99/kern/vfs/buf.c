@@ -0,0 +1,778 @@
+/*
+ * Buffer cache. See buf.h for the interface.
+ *
+ * All the cache's own state (the hash chains, the LRU list, and the
+ * b_dev/b_block/b_busy fields of every buffer) is protected by
+ * buffer_lock. The data, and b_valid and b_dirty, belong to whoever
+ * has the buffer busy; device I/O is done with the buffer busy and
+ * buffer_lock released, so one thread's disk wait doesn't hold up
+ * hits on other blocks.
+ *
+ * buffer_lock is a leaf: nothing else is acquired while holding it,
+ * apart from kmalloc.
+ *
+ * Read-ahead is done by a couple of worker threads that take block
+ * numbers off a small ring (also under buffer_lock) and read them in
+ * exactly as buffer_read would, so the caller doesn't wait. Because
+ * the worker holds the buffer busy while the read is in progress, a
+ * client that asks for the block meanwhile simply waits for it as it
+ * would for any other busy buffer. Read-ahead is only advice: if the
+ * ring is full, or a worker can't get a buffer, the block is skipped.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <device.h>
+#include <buf.h>
+
+/* Read-ahead worker threads, and blocks that can be waiting for them. */
+#define BUFFER_RATHREADS 2
+#define BUFFER_RAQUEUE   32
+
+/*
+ * Limits on the number of buffers. Physical memory is small, so a new
+ * buffer is only made if the data in all of them stays within
+ * BUFFER_MAXBYTES (with 512-byte blocks, that's BUFFER_MAXBUFS of
+ * them). But however large the blocks, there can always be
+ * BUFFER_MINBUFS. buffer_get waits when every buffer is busy, so
+ * that's enough for four threads (say the syncer, the orphan thread
+ * and two processes) each holding BUFFER_MAXHOLD, and one more for
+ * each read-ahead worker.
+ */
+#define BUFFER_MAXBUFS  64
+#define BUFFER_MAXBYTES (64*512)
+#define BUFFER_MINBUFS  (4*BUFFER_MAXHOLD + BUFFER_RATHREADS)
+
+/* Number of hash chains; should be prime. */
+#define BUFFER_HASHSIZE 61
+
+struct buf {
+	struct device *b_dev;		/* device, or NULL if not hashed */
+	uint32_t b_block;		/* block number on b_dev */
+	size_t b_size;			/* size of b_data */
+	void *b_data;			/* the block */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data must be written back */
+	bool b_busy;			/* handed out by buffer_get */
+	bool b_readahead;		/* read ahead, not yet asked for */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list; head is most recent */
+	struct buf *b_lrunext;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;		/* signalled when a buffer unbusies */
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead, *buffer_lrutail;
+static unsigned buffer_count;
+static size_t buffer_bytes;		/* total of b_size */
+
+/* Read-ahead requests waiting for a worker; also under buffer_lock. */
+static struct {
+	struct device *ra_dev;
+	uint32_t ra_block;
+	size_t ra_size;
+} buffer_raq[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_racount;
+static struct cv *buffer_racv;		/* signalled when a request arrives */
+
+/* Device each worker is reading from, or NULL; under buffer_lock. */
+static struct device *buffer_radev[BUFFER_RATHREADS];
+
+/* Statistics, protected by buffer_lock. */
+static unsigned buffer_hits, buffer_misses;
+static unsigned buffer_evictions, buffer_writebacks;
+static unsigned buffer_ranqueued, buffer_radropped;
+static unsigned buffer_raread, buffer_raused, buffer_rawasted;
+
+static void buffer_rathread(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	char name[16];
+	unsigned i;
+	int result;
+
+	buffer_lock = lock_create("buffer_lock");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer_cv");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_racv = cv_create("buffer_racv");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+
+	/* The workers wait on buffer_racv until there's something to do */
+	for (i=0; i<BUFFER_RATHREADS; i++) {
+		snprintf(name, sizeof(name), "readahead%u", i);
+		result = thread_fork(name, NULL, buffer_rathread, NULL, i);
+		if (result) {
+			panic("buffer_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, uint32_t block)
+{
+	return (((uintptr_t)dev >> 4) + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfunc(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_add(struct buf *b)
+{
+	unsigned h;
+
+	KASSERT(b->b_dev != NULL);
+	h = buffer_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	if (b->b_dev == NULL) {
+		/* not hashed */
+		return;
+	}
+	bp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lru_addhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+static
+void
+buffer_lru_addtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+////////////////////////////////////////////////////////////
+// Device I/O
+
+/*
+ * Read or write a busy buffer. Called without buffer_lock.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+
+	DEBUG(DB_VFS, "buffer: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, b->b_size,
+		  ((off_t)b->b_block) * b->b_size, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write back a dirty buffer that is not busy. Called with
+ * buffer_lock held; releases it during the I/O.
+ */
+static
+int
+buffer_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+	KASSERT(b->b_valid && b->b_dirty);
+
+	b->b_busy = true;
+	lock_release(buffer_lock);
+
+	result = buffer_io(b, UIO_WRITE);
+
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		b->b_dirty = false;
+		buffer_writebacks++;
+	}
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+/*
+ * Number of buffers that aren't busy.
+ */
+static
+unsigned
+buffer_nfree(void)
+{
+	struct buf *b;
+	unsigned n = 0;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * buffer_get, for clients and the read-ahead workers. If WAIT is
+ * false, fail with EAGAIN instead of waiting for a busy buffer, and
+ * instead of taking one of the last BUFFER_MAXHOLD free buffers;
+ * read-ahead mustn't use up what the clients need.
+ */
+static
+int
+buffer_doget(struct device *dev, uint32_t block, size_t size, bool wait,
+	     struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(size > 0 && size % dev->d_blocksize == 0);
+
+	lock_acquire(buffer_lock);
+
+ retry:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			if (!wait) {
+				lock_release(buffer_lock);
+				return EAGAIN;
+			}
+			cv_wait(buffer_cv, buffer_lock);
+			goto retry;
+		}
+		KASSERT(b->b_size == size);
+		b->b_busy = true;
+		buffer_lru_remove(b);
+		buffer_lru_addhead(b);
+		buffer_hits++;
+		if (b->b_readahead) {
+			b->b_readahead = false;
+			buffer_raused++;
+		}
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	/*
+	 * Not cached. Make a new buffer if we're under the limit;
+	 * otherwise take the least recently used one that isn't
+	 * busy, writing it back first if necessary. The writeback
+	 * drops the lock, so after it everything has to be looked
+	 * at again.
+	 */
+	if (buffer_count < BUFFER_MAXBUFS &&
+	    (buffer_count < BUFFER_MINBUFS ||
+	     buffer_bytes + size <= BUFFER_MAXBYTES)) {
+		b = kmalloc(sizeof(*b));
+		if (b == NULL) {
+			lock_release(buffer_lock);
+			return ENOMEM;
+		}
+		b->b_data = kmalloc(size);
+		if (b->b_data == NULL) {
+			kfree(b);
+			lock_release(buffer_lock);
+			return ENOMEM;
+		}
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_size = size;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		b->b_readahead = false;
+		b->b_hashnext = NULL;
+		b->b_lruprev = b->b_lrunext = NULL;
+		buffer_lru_addtail(b);
+		buffer_count++;
+		buffer_bytes += size;
+	}
+	else {
+		if (!wait && buffer_nfree() <= BUFFER_MAXHOLD) {
+			lock_release(buffer_lock);
+			return EAGAIN;
+		}
+		for (b = buffer_lrutail; b != NULL; b = b->b_lruprev) {
+			if (!b->b_busy) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			cv_wait(buffer_cv, buffer_lock);
+			goto retry;
+		}
+		if (b->b_dev != NULL && b->b_dirty) {
+			result = buffer_writeback(b);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+			goto retry;
+		}
+		if (b->b_dev != NULL) {
+			buffer_evictions++;
+			if (b->b_readahead) {
+				buffer_rawasted++;
+			}
+		}
+		buffer_hash_remove(b);
+	}
+
+	if (b->b_size != size) {
+		if (b->b_data != NULL) {
+			kfree(b->b_data);
+		}
+		buffer_bytes -= b->b_size;
+		b->b_size = size;
+		b->b_data = kmalloc(size);
+		if (b->b_data == NULL) {
+			/* leave it on the LRU list, unhashed, for reuse */
+			b->b_size = 0;
+			lock_release(buffer_lock);
+			return ENOMEM;
+		}
+		buffer_bytes += size;
+	}
+
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = true;
+	b->b_readahead = false;
+	buffer_hash_add(b);
+	buffer_lru_remove(b);
+	buffer_lru_addhead(b);
+	buffer_misses++;
+
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Client interface
+
+int
+buffer_get(struct device *dev, uint32_t block, size_t size,
+	   struct buf **ret)
+{
+	return buffer_doget(dev, block, size, true, ret);
+}
+
+int
+buffer_read(struct device *dev, uint32_t block, size_t size,
+	    struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_get(dev, block, size, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = buffer_io(b, UIO_READ);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_isvalid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Ask for BLOCK to be read in the background. Quietly does nothing
+ * if it's already cached or already asked for.
+ */
+void
+buffer_readahead(struct device *dev, uint32_t block, size_t size)
+{
+	unsigned i, j;
+
+	KASSERT(size > 0 && size % dev->d_blocksize == 0);
+
+	lock_acquire(buffer_lock);
+	if (buffer_find(dev, block) != NULL) {
+		lock_release(buffer_lock);
+		return;
+	}
+	for (i=0; i<buffer_racount; i++) {
+		j = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raq[j].ra_dev == dev &&
+		    buffer_raq[j].ra_block == block) {
+			lock_release(buffer_lock);
+			return;
+		}
+	}
+	if (buffer_racount == BUFFER_RAQUEUE) {
+		/* The blocks already queued are needed sooner */
+		buffer_radropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	j = (buffer_rahead + buffer_racount) % BUFFER_RAQUEUE;
+	buffer_raq[j].ra_dev = dev;
+	buffer_raq[j].ra_block = block;
+	buffer_raq[j].ra_size = size;
+	buffer_racount++;
+	buffer_ranqueued++;
+	cv_signal(buffer_racv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Read-ahead worker. NUM is its index in buffer_radev.
+ */
+static
+void
+buffer_rathread(void *unused, unsigned long num)
+{
+	struct device *dev;
+	uint32_t block;
+	size_t size;
+	struct buf *b;
+	int result;
+
+	(void)unused;
+	KASSERT(num < BUFFER_RATHREADS);
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		dev = buffer_raq[buffer_rahead].ra_dev;
+		block = buffer_raq[buffer_rahead].ra_block;
+		size = buffer_raq[buffer_rahead].ra_size;
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_racount--;
+		buffer_radev[num] = dev;
+		lock_release(buffer_lock);
+
+		/* Skip it rather than wait, or take the last buffers */
+		result = buffer_doget(dev, block, size, false, &b);
+		if (result == 0 && !b->b_valid) {
+			if (buffer_io(b, UIO_READ) == 0) {
+				b->b_valid = true;
+				b->b_readahead = true;
+			}
+		}
+
+		lock_acquire(buffer_lock);
+		if (result == 0) {
+			if (b->b_readahead) {
+				buffer_raread++;
+			}
+			b->b_busy = false;
+		}
+		else if (result == EAGAIN) {
+			buffer_radropped++;
+		}
+		buffer_radev[num] = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+void
+buffer_drop(struct device *dev, uint32_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+ retry:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+			goto retry;
+		}
+		KASSERT(b->b_size == size);
+		buffer_hash_remove(b);
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_readahead = false;
+		/* reuse it first */
+		buffer_lru_remove(b);
+		buffer_lru_addtail(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back everything dirty on DEV. Each pass writes the lowest
+ * numbered dirty block, so the writes go out in ascending order,
+ * which is what the disk likes best.
+ */
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b, *best;
+	int result;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		best = NULL;
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_dev != dev || !b->b_dirty || b->b_busy) {
+				continue;
+			}
+			if (best == NULL || b->b_block < best->b_block) {
+				best = b;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		result = buffer_writeback(best);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_invalidate(struct device *dev)
+{
+	struct buf *b;
+	unsigned i, j, n;
+
+	lock_acquire(buffer_lock);
+
+	/* Forget queued read-ahead, and wait for any in progress */
+ retry:
+	n = buffer_racount;
+	buffer_racount = 0;
+	for (i=0; i<n; i++) {
+		j = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raq[j].ra_dev != dev) {
+			buffer_raq[(buffer_rahead + buffer_racount++)
+				   % BUFFER_RAQUEUE] = buffer_raq[j];
+		}
+	}
+	for (i=0; i<BUFFER_RATHREADS; i++) {
+		if (buffer_radev[i] == dev) {
+			cv_wait(buffer_cv, buffer_lock);
+			goto retry;
+		}
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev == dev) {
+			KASSERT(!b->b_busy);
+			KASSERT(!b->b_dirty);
+			buffer_hash_remove(b);
+			b->b_valid = false;
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	struct buf *b;
+	unsigned nhashed = 0, ndirty = 0, nbusy = 0, count, bytes;
+	unsigned hits, misses, evictions, writebacks, total;
+	unsigned ranqueued, radropped, raread, raused, rawasted;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev != NULL) {
+			nhashed++;
+		}
+		if (b->b_dirty) {
+			ndirty++;
+		}
+		if (b->b_busy) {
+			nbusy++;
+		}
+	}
+	count = buffer_count;
+	bytes = buffer_bytes;
+	hits = buffer_hits;
+	misses = buffer_misses;
+	evictions = buffer_evictions;
+	writebacks = buffer_writebacks;
+	ranqueued = buffer_ranqueued;
+	radropped = buffer_radropped;
+	raread = buffer_raread;
+	raused = buffer_raused;
+	rawasted = buffer_rawasted;
+	lock_release(buffer_lock);
+
+	total = hits + misses;
+	kprintf("Buffer cache: %u of %u buffers in use, %u dirty, %u busy, "
+		"%u bytes\n", nhashed, count, ndirty, nbusy, bytes);
+	kprintf("    %u hits, %u misses (%u%% hit rate)\n", hits, misses,
+		total == 0 ? 0 : (hits * 100) / total);
+	kprintf("    %u evictions, %u writebacks\n", evictions, writebacks);
+	kprintf("    read-ahead: %u queued, %u dropped, %u read, "
+		"%u used, %u evicted unused\n", ranqueued, radropped,
+		raread, raused, rawasted);
+}
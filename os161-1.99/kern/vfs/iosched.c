@@ -0,0 +1,182 @@
+/*
+ * Disk I/O scheduler. See iosched.h for the interface.
+ *
+ * The queue is a singly linked list kept sorted by the distance of
+ * each request's first sector past is_head, computed in unsigned
+ * arithmetic so that sectors below the head come out as large
+ * distances. That is exactly C-LOOK order: the rest of the current
+ * sweep, lowest first, then the next sweep from the bottom of the
+ * disk. iosched_next pops the front and moves the head just past that
+ * request's first sector, which leaves the rest of the list in order.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <iosched.h>
+
+/* All schedulers, for iosched_printstats. */
+static struct spinlock iosched_listlock = SPINLOCK_INITIALIZER;
+static struct iosched *iosched_list;
+
+/*
+ * Microseconds from SECS/NSECS to now.
+ */
+static
+uint32_t
+iosched_since(time_t secs, uint32_t nsecs)
+{
+	time_t now, dsecs;
+	uint32_t nownsecs, dnsecs;
+
+	gettime(&now, &nownsecs);
+	getinterval(secs, nsecs, now, nownsecs, &dsecs, &dnsecs);
+	return dsecs*1000000 + dnsecs/1000;
+}
+
+void
+iosched_init(struct iosched *is, const char *name)
+{
+	snprintf(is->is_name, sizeof(is->is_name), "%s", name);
+	is->is_queue = NULL;
+	is->is_head = 0;
+	is->is_depth = 0;
+
+	is->is_nreqs = 0;
+	is->is_nbatched = 0;
+	is->is_nsectors = 0;
+	is->is_maxdepth = 0;
+	is->is_depthsum = 0;
+	is->is_waitus = 0;
+	is->is_svcus = 0;
+
+	spinlock_acquire(&iosched_listlock);
+	is->is_nextsched = iosched_list;
+	iosched_list = is;
+	spinlock_release(&iosched_listlock);
+}
+
+void
+iosched_cleanup(struct iosched *is)
+{
+	struct iosched **pp;
+
+	KASSERT(is->is_queue == NULL);
+	KASSERT(is->is_depth == 0);
+
+	spinlock_acquire(&iosched_listlock);
+	for (pp = &iosched_list; *pp != NULL; pp = &(*pp)->is_nextsched) {
+		if (*pp == is) {
+			*pp = is->is_nextsched;
+			break;
+		}
+	}
+	spinlock_release(&iosched_listlock);
+}
+
+void
+iosched_add(struct iosched *is, struct ioreq *req)
+{
+	struct ioreq **pp, *prev;
+	uint32_t dist;
+
+	gettime(&req->ir_qsecs, &req->ir_qnsecs);
+
+	is->is_depth++;
+	is->is_depthsum += is->is_depth;
+	if (is->is_depth > is->is_maxdepth) {
+		is->is_maxdepth = is->is_depth;
+	}
+
+	/* Find the first request further along the sweep than this one */
+	dist = req->ir_sector - is->is_head;
+	prev = NULL;
+	for (pp = &is->is_queue; *pp != NULL; pp = &(*pp)->ir_next) {
+		if ((*pp)->ir_sector - is->is_head > dist) {
+			break;
+		}
+		prev = *pp;
+	}
+	req->ir_next = *pp;
+	*pp = req;
+
+	/* Count it if it's going to run straight on from a neighbor */
+	if ((prev != NULL && prev->ir_write == req->ir_write &&
+	     prev->ir_sector + prev->ir_nsect == req->ir_sector) ||
+	    (req->ir_next != NULL && req->ir_next->ir_write == req->ir_write &&
+	     req->ir_sector + req->ir_nsect == req->ir_next->ir_sector)) {
+		is->is_nbatched++;
+	}
+}
+
+struct ioreq *
+iosched_next(struct iosched *is)
+{
+	struct ioreq *req;
+
+	req = is->is_queue;
+	if (req == NULL) {
+		return NULL;
+	}
+	is->is_queue = req->ir_next;
+	req->ir_next = NULL;
+
+	/*
+	 * Whatever starts right after this request's first sector is
+	 * next in the sweep; this request's own sector, if asked for
+	 * again, waits for the next sweep.
+	 */
+	is->is_head = req->ir_sector + 1;
+
+	gettime(&req->ir_ssecs, &req->ir_snsecs);
+	is->is_waitus += iosched_since(req->ir_qsecs, req->ir_qnsecs);
+	return req;
+}
+
+void
+iosched_done(struct iosched *is, struct ioreq *req)
+{
+	KASSERT(is->is_depth > 0);
+	is->is_depth--;
+
+	is->is_nreqs++;
+	is->is_nsectors += req->ir_nsect;
+	is->is_svcus += iosched_since(req->ir_ssecs, req->ir_snsecs);
+}
+
+/*
+ * The counters are read without the drivers' locks; they might be a
+ * little inconsistent with each other if there's I/O going on.
+ */
+void
+iosched_printstats(void)
+{
+	struct iosched *is;
+	unsigned n;
+
+	spinlock_acquire(&iosched_listlock);
+	is = iosched_list;
+	spinlock_release(&iosched_listlock);
+
+	if (is == NULL) {
+		kprintf("No disks\n");
+		return;
+	}
+
+	/* Schedulers are only removed if a disk fails to attach */
+	for (; is != NULL; is = is->is_nextsched) {
+		n = is->is_nreqs;
+		kprintf("%s: %u requests, %u sectors, %u batched "
+			"with a neighbor\n", is->is_name, n, is->is_nsectors,
+			is->is_nbatched);
+		if (n == 0) {
+			continue;
+		}
+		kprintf("    queue depth: now %u, max %u, avg %u.%02u\n",
+			is->is_depth, is->is_maxdepth,
+			is->is_depthsum / n, (is->is_depthsum % n) * 100 / n);
+		kprintf("    avg usec: %u queued, %u in service\n",
+			is->is_waitus / n, is->is_svcus / n);
+	}
+}
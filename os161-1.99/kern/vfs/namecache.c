@@ -0,0 +1,334 @@
+/*
+ * Name lookup cache. See namecache.h for the interface.
+ *
+ * The entries are a fixed array, threaded on an LRU list (most
+ * recently used first) and, when in use, on hash chains keyed by
+ * directory and name. Unused entries have nc_dir NULL and sit at the
+ * tail of the LRU list, so they're taken first.
+ *
+ * Everything is protected by namecache_lock, a spinlock; nothing is
+ * done while holding it but list manipulation, string compares, and
+ * VOP_INCREF. References are dropped after releasing it, because
+ * dropping the last one reclaims the vnode.
+ *
+ * namecache_gen counts purges. A lookup that misses notes it before
+ * going to the filesystem, and namecache_enter won't add the result
+ * if it has changed, because the name may have been changed by a
+ * remove or rename that finished while the filesystem was looking.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/* Number of entries */
+#define NAMECACHE_SIZE 64
+
+/* Number of hash chains */
+#define NAMECACHE_HASHSIZE 32
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* vnode found, or NULL if ENOENT */
+	char nc_name[NAMECACHE_NAMELEN+1];
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list */
+	struct ncentry *nc_lrunext;
+};
+
+static struct spinlock namecache_lock = SPINLOCK_INITIALIZER;
+static struct ncentry namecache_entries[NAMECACHE_SIZE];
+static struct ncentry *namecache_hash[NAMECACHE_HASHSIZE];
+static struct ncentry *namecache_lruhead, *namecache_lrutail;
+static unsigned namecache_gen;
+
+/* statistics */
+static unsigned namecache_hits;		/* found a vnode */
+static unsigned namecache_neghits;	/* found that there isn't one */
+static unsigned namecache_misses;	/* had to ask the filesystem */
+static unsigned namecache_toolong;	/* names too long to cache */
+static unsigned namecache_evictions;	/* entries reused */
+static unsigned namecache_purged;	/* entries dropped by purges */
+
+////////////////////////////////////////////////////////////
+// lists
+
+static
+unsigned
+namecache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir >> 4;
+	while (*name != 0) {
+		h = h*31 + (unsigned char)*name;
+		name++;
+	}
+	return h % NAMECACHE_HASHSIZE;
+}
+
+static
+void
+namecache_lru_remove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		namecache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		namecache_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+namecache_lru_addhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = namecache_lruhead;
+	if (namecache_lruhead != NULL) {
+		namecache_lruhead->nc_lruprev = nc;
+	}
+	else {
+		namecache_lrutail = nc;
+	}
+	namecache_lruhead = nc;
+}
+
+static
+void
+namecache_lru_addtail(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = namecache_lrutail;
+	if (namecache_lrutail != NULL) {
+		namecache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		namecache_lruhead = nc;
+	}
+	namecache_lrutail = nc;
+}
+
+/*
+ * Take NC, which is in use, off its hash chain and mark it unused.
+ * Its references become the caller's.
+ */
+static
+void
+namecache_unhash(struct ncentry *nc)
+{
+	struct ncentry **pp;
+
+	pp = &namecache_hash[namecache_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*pp != nc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+}
+
+static
+struct ncentry *
+namecache_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	nc = namecache_hash[namecache_hashfunc(dir, name)];
+	for (; nc != NULL; nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+void
+namecache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NAMECACHE_HASHSIZE; i++) {
+		namecache_hash[i] = NULL;
+	}
+	namecache_lruhead = namecache_lrutail = NULL;
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		namecache_entries[i].nc_dir = NULL;
+		namecache_entries[i].nc_vn = NULL;
+		namecache_entries[i].nc_hashnext = NULL;
+		namecache_lru_addtail(&namecache_entries[i]);
+	}
+}
+
+bool
+namecache_lookup(struct vnode *dir, const char *name,
+		 struct vnode **ret, unsigned *gen)
+{
+	struct ncentry *nc;
+
+	spinlock_acquire(&namecache_lock);
+	if (strlen(name) > NAMECACHE_NAMELEN) {
+		namecache_toolong++;
+		*gen = namecache_gen;
+		spinlock_release(&namecache_lock);
+		return false;
+	}
+	nc = namecache_find(dir, name);
+	if (nc == NULL) {
+		namecache_misses++;
+		*gen = namecache_gen;
+		spinlock_release(&namecache_lock);
+		return false;
+	}
+
+	namecache_lru_remove(nc);
+	namecache_lru_addhead(nc);
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		namecache_hits++;
+	}
+	else {
+		namecache_neghits++;
+	}
+	*ret = nc->nc_vn;
+	spinlock_release(&namecache_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		unsigned gen)
+{
+	struct ncentry *nc;
+	struct vnode *olddir, *oldvn;
+
+	if (strlen(name) > NAMECACHE_NAMELEN) {
+		return;
+	}
+
+	/* Take references for the entry before we get the lock */
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&namecache_lock);
+	if (gen != namecache_gen || namecache_find(dir, name) != NULL) {
+		/* Out of date, or someone else beat us to it */
+		spinlock_release(&namecache_lock);
+		if (vn != NULL) {
+			VOP_DECREF(vn);
+		}
+		VOP_DECREF(dir);
+		return;
+	}
+
+	/* Reuse the least recently used entry */
+	nc = namecache_lrutail;
+	olddir = nc->nc_dir;
+	oldvn = nc->nc_vn;
+	if (olddir != NULL) {
+		namecache_unhash(nc);
+		namecache_evictions++;
+	}
+
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	nc->nc_hashnext = namecache_hash[namecache_hashfunc(dir, name)];
+	namecache_hash[namecache_hashfunc(dir, name)] = nc;
+	namecache_lru_remove(nc);
+	namecache_lru_addhead(nc);
+	spinlock_release(&namecache_lock);
+
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+	if (olddir != NULL) {
+		VOP_DECREF(olddir);
+	}
+}
+
+void
+namecache_purge(struct fs *fs, bool negonly)
+{
+	struct ncentry *nc;
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	spinlock_acquire(&namecache_lock);
+	namecache_gen++;
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		nc = &namecache_entries[i];
+		if (nc->nc_dir == NULL ||
+		    (fs != NULL && nc->nc_dir->vn_fs != fs) ||
+		    (negonly && nc->nc_vn != NULL)) {
+			continue;
+		}
+
+		dir = nc->nc_dir;
+		vn = nc->nc_vn;
+		namecache_unhash(nc);
+		namecache_lru_remove(nc);
+		namecache_lru_addtail(nc);
+		namecache_purged++;
+
+		/* Drop the references without the lock */
+		spinlock_release(&namecache_lock);
+		if (vn != NULL) {
+			VOP_DECREF(vn);
+		}
+		VOP_DECREF(dir);
+		spinlock_acquire(&namecache_lock);
+	}
+	spinlock_release(&namecache_lock);
+}
+
+void
+namecache_printstats(void)
+{
+	struct ncentry *nc;
+	unsigned npos = 0, nneg = 0;
+	unsigned hits, neghits, misses, toolong, evictions, purged, total;
+
+	spinlock_acquire(&namecache_lock);
+	for (nc = namecache_lruhead; nc != NULL; nc = nc->nc_lrunext) {
+		if (nc->nc_dir == NULL) {
+			continue;
+		}
+		if (nc->nc_vn != NULL) {
+			npos++;
+		}
+		else {
+			nneg++;
+		}
+	}
+	hits = namecache_hits;
+	neghits = namecache_neghits;
+	misses = namecache_misses;
+	toolong = namecache_toolong;
+	evictions = namecache_evictions;
+	purged = namecache_purged;
+	spinlock_release(&namecache_lock);
+
+	total = hits + neghits + misses + toolong;
+	kprintf("Name cache: %u of %u entries in use, %u found, "
+		"%u not found\n", npos + nneg, NAMECACHE_SIZE, npos, nneg);
+	kprintf("    %u hits, %u negative hits, %u misses, %u too long "
+		"(%u%% hit rate)\n", hits, neghits, misses, toolong,
+		total == 0 ? 0 : ((hits + neghits) * 100) / total);
+	kprintf("    %u evictions, %u purged\n", evictions, purged);
+}
@@ -38,7 +38,21 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <namecache.h>
 
+/*
+ * Drop the name cache entries that a change to the names in DIR may
+ * have made wrong: if CREATED, only the failed lookups (which a new
+ * name may now satisfy); otherwise all of them.
+ */
+static
+void
+vfs_namechanged(struct vnode *dir, bool created)
+{
+	if (dir->vn_fs != NULL) {
+		namecache_purge(dir->vn_fs, created);
+	}
+}
 
 /* Does most of the work for open(). */
 int
@@ -74,6 +88,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			vfs_namechanged(dir, true);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +167,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_namechanged(dir, false);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +201,7 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_namechanged(olddir, false);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +236,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_namechanged(newdir, true);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +266,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_namechanged(newdir, true);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +315,9 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		vfs_namechanged(parent, true);
+	}
 
 	VOP_DECREF(parent);
 
@@ -312,6 +340,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_namechanged(parent, false);
 
 	VOP_DECREF(parent);
 
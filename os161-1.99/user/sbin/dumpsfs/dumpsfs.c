@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -56,28 +57,104 @@
 
 #include "disk.h"
 
+/* Block size of the volume */
+static uint32_t blocksize;
+
+/*
+ * Read the first LEN bytes of BLOCK into DATA; for the superblock
+ * and inodes, which are smaller than a block if the blocks are large.
+ */
+static
+void
+diskreadpart(void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	diskread(buf, block);
+	memcpy(data, buf, len);
+}
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
+
+	/* The superblock is one sector; read it before knowing the size */
 	diskread(&sp, SFS_SB_LOCATION);
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = SFS_FSBLOCKSIZE(SWAPL(sp.sp_blocksize));
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Bad block size %u", blocksize);
+	}
+	disksetblocksize(blocksize);
+
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
-	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
-	       SWAPL(sp.sp_nblocks));
+	printf("Volume name: %-40s  %u blocks of %u bytes\n", sp.sp_volname, 
+	       SWAPL(sp.sp_nblocks), blocksize);
 
 	return SWAPL(sp.sp_nblocks);
 }
 
+/*
+ * Call FUNC(DATA, block) for each data block under indirect block
+ * IBLOCK, which is INDIRECTION levels above the data (1 for the
+ * single indirect block), in file order. Holes are skipped.
+ */
+static
+void
+walkindirect(uint32_t iblock, int indirection,
+	     void (*func)(void *, uint32_t), void *data)
+{
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	unsigned i;
+
+	if (iblock == 0) {
+		return;
+	}
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+		if (SWAPL(ib[i]) == 0) {
+			continue;
+		}
+		if (indirection > 1) {
+			walkindirect(SWAPL(ib[i]), indirection-1, func, data);
+		}
+		else {
+			func(data, SWAPL(ib[i]));
+		}
+	}
+}
+
+/*
+ * Same, for all the data blocks of a file.
+ */
+static
+void
+walkfile(const struct sfs_inode *sfi, void (*func)(void *, uint32_t),
+	 void *data)
+{
+	int i;
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (SWAPL(sfi->sfi_direct[i]) != 0) {
+			func(data, SWAPL(sfi->sfi_direct[i]));
+		}
+	}
+	walkindirect(SWAPL(sfi->sfi_indirect), 1, func, data);
+	walkindirect(SWAPL(sfi->sfi_dindirect), 2, func, data);
+	walkindirect(SWAPL(sfi->sfi_tindirect), 3, func, data);
+}
+
 static
 void
 dodirblock(uint32_t block)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
 	int i;
 
 	diskread(&sds, block);
@@ -95,16 +172,25 @@ dodirblock(uint32_t block)
 	}
 }
 
+static
+void
+dumpdirblock(void *data, uint32_t block)
+{
+	uint32_t *nblocks = data;
+
+	dodirblock(block);
+	(*nblocks)++;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
-	uint32_t block, nblocks=0;
+	int nentries;
+	uint32_t nblocks=0;
 
-	diskread(&sfi, ino);
+	diskreadpart(&sfi, sizeof(sfi), ino);
 
 	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
@@ -112,23 +198,7 @@ dumpdir(uint32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = SWAPL(sfi.sfi_direct[i]);
-		if (block) {
-			dodirblock(block);
-			nblocks++;
-		}
-	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
-	}
+	walkfile(&sfi, dumpdirblock, &nblocks);
 	printf("    %u blocks in directory\n", nblocks);
 }
 
@@ -136,15 +206,17 @@ static
 void
 dumpbits(uint32_t fsblocks)
 {
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	uint32_t i, j;
-	char data[SFS_BLOCKSIZE];
+	char data[SFS_MAXBLOCKSIZE];
 
-	printf("Freemap: %u blocks (%u %u %u)\n", nblocks, SFS_BITMAPSIZE(fsblocks), fsblocks, SFS_BLOCKBITS);
+	printf("Freemap: %u blocks (%u %u %u)\n", nblocks,
+	       SFS_BITMAPSIZE(fsblocks, blocksize), fsblocks,
+	       SFS_BLOCKBITS(blocksize));
 
 	for (i=0; i<nblocks; i++) {
 		diskread(data, SFS_MAP_LOCATION+i);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			printf("%02x", (unsigned char)data[j]);
 			if (j%32==31) {
 				printf("\n");
@@ -154,6 +226,279 @@ dumpbits(uint32_t fsblocks)
 	printf("\n");
 }
 
+/*
+ * Fragmentation report.
+ *
+ * For each file on the volume, count the extents (runs of consecutive
+ * disk blocks, in file order) its data occupies; then count the runs
+ * of free blocks in the freemap. The directories are read breadth
+ * first from the root. A file with more than one name is counted
+ * under the first name found.
+ */
+
+struct extentcount {
+	uint32_t blocks;	/* data blocks */
+	uint32_t extents;	/* runs of consecutive blocks */
+	uint32_t lastblock;	/* previous block seen, or 0 */
+};
+
+static
+void
+countblock(void *data, uint32_t block)
+{
+	struct extentcount *ec = data;
+
+	if (ec->lastblock == 0 || block != ec->lastblock + 1) {
+		ec->extents++;
+	}
+	ec->blocks++;
+	ec->lastblock = block;
+}
+
+static
+void
+countfile(const struct sfs_inode *sfi, struct extentcount *ec)
+{
+	ec->blocks = ec->extents = ec->lastblock = 0;
+	walkfile(sfi, countblock, ec);
+}
+
+/* Print A/B with two decimal places (no floating point in our libc) */
+static
+void
+printratio(uint32_t a, uint32_t b)
+{
+	uint32_t hundredths;
+
+	if (b == 0) {
+		printf("-");
+		return;
+	}
+	hundredths = (uint32_t)(((uint64_t)a * 100 + b/2) / b);
+	printf("%u.%02u", hundredths / 100, hundredths % 100);
+}
+
+/* A directory waiting to be read, with its path from the root */
+struct fragdir {
+	uint32_t fd_ino;
+	char *fd_path;
+	struct fragdir *fd_next;
+};
+
+/* State and totals for the report */
+struct fragtotals {
+	uint32_t nfiles, nfragged, totblocks, totextents;
+	uint32_t ndirs, dirblocks, dirextents;
+	uint32_t fsblocks;
+	unsigned char *seen;		/* inodes already counted */
+	const char *path;		/* directory being read */
+	struct fragdir *queuehead;	/* directories still to read */
+	struct fragdir *queuetail;
+};
+
+static
+void *
+domalloc(size_t len)
+{
+	void *x;
+
+	x = malloc(len);
+	if (x == NULL) {
+		errx(1, "Out of memory");
+	}
+	return x;
+}
+
+/*
+ * Mark inode INO seen; returns true if it already was.
+ */
+static
+int
+fragseen(struct fragtotals *ft, uint32_t ino)
+{
+	unsigned char bit = 1 << (ino % CHAR_BIT);
+	int was;
+
+	was = (ft->seen[ino/CHAR_BIT] & bit) != 0;
+	ft->seen[ino/CHAR_BIT] |= bit;
+	return was;
+}
+
+/*
+ * Put directory INO on the list to read. Takes over PATH.
+ */
+static
+void
+fragqueue(struct fragtotals *ft, uint32_t ino, char *path)
+{
+	struct fragdir *fd;
+
+	fd = domalloc(sizeof(*fd));
+	fd->fd_ino = ino;
+	fd->fd_path = path;
+	fd->fd_next = NULL;
+	if (ft->queuetail == NULL) {
+		ft->queuehead = fd;
+	}
+	else {
+		ft->queuetail->fd_next = fd;
+	}
+	ft->queuetail = fd;
+}
+
+/*
+ * Report on the files listed in one block of a directory, and queue
+ * its subdirectories.
+ */
+static
+void
+fragdirblock(void *data, uint32_t block)
+{
+	struct fragtotals *ft = data;
+	struct sfs_inode sfi;
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
+	struct extentcount ec;
+	uint32_t ino;
+	char *path;
+	int j;
+
+	diskread(&sds, block);
+	for (j=0; j<nsds; j++) {
+		ino = SWAPL(sds[j].sfd_ino);
+		if (ino == SFS_NOINO) {
+			continue;
+		}
+		sds[j].sfd_name[SFS_NAMELEN-1] = 0;
+		if (!strcmp(sds[j].sfd_name, ".") ||
+		    !strcmp(sds[j].sfd_name, "..")) {
+			continue;
+		}
+		if (ino >= ft->fsblocks) {
+			warnx("%s/%s: inode %u is past the end of the volume",
+			      ft->path, sds[j].sfd_name, ino);
+			continue;
+		}
+		if (fragseen(ft, ino)) {
+			continue;
+		}
+
+		path = domalloc(strlen(ft->path) + strlen(sds[j].sfd_name)
+				+ 2);
+		strcpy(path, ft->path);
+		if (path[0] != 0) {
+			strcat(path, "/");
+		}
+		strcat(path, sds[j].sfd_name);
+
+		diskreadpart(&sfi, sizeof(sfi), ino);
+		if (SWAPS(sfi.sfi_type) == SFS_TYPE_DIR) {
+			fragqueue(ft, ino, path);
+			continue;
+		}
+
+		countfile(&sfi, &ec);
+		printf("    %8u %8u %8u  %s\n", ino, ec.blocks, 
+		       ec.extents, path);
+		ft->nfiles++;
+		ft->totblocks += ec.blocks;
+		ft->totextents += ec.extents;
+		if (ec.extents > 1) {
+			ft->nfragged++;
+		}
+		free(path);
+	}
+}
+
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	struct sfs_inode dir;
+	struct extentcount dirblocks;
+	struct fragtotals ft;
+	struct fragdir *fd;
+	char *path;
+	uint32_t nfree = 0, freeruns = 0, run = 0, maxrun = 0;
+	char data[SFS_MAXBLOCKSIZE];
+	uint32_t bitblocks = SFS_BITBLOCKS(fsblocks, blocksize);
+	uint32_t i;
+
+	printf("Fragmentation:\n");
+	printf("    %8s %8s %8s  %s\n", "inode", "blocks", "extents", "name");
+
+	ft.nfiles = ft.nfragged = ft.totblocks = ft.totextents = 0;
+	ft.ndirs = ft.dirblocks = ft.dirextents = 0;
+	ft.fsblocks = fsblocks;
+	ft.seen = domalloc((fsblocks + CHAR_BIT - 1) / CHAR_BIT);
+	memset(ft.seen, 0, (fsblocks + CHAR_BIT - 1) / CHAR_BIT);
+	ft.queuehead = ft.queuetail = NULL;
+
+	fragseen(&ft, SFS_ROOT_LOCATION);
+	path = domalloc(1);
+	path[0] = 0;
+	fragqueue(&ft, SFS_ROOT_LOCATION, path);
+
+	while (ft.queuehead != NULL) {
+		fd = ft.queuehead;
+		ft.queuehead = fd->fd_next;
+		if (ft.queuehead == NULL) {
+			ft.queuetail = NULL;
+		}
+
+		/* The directory's own blocks, in order */
+		diskreadpart(&dir, sizeof(dir), fd->fd_ino);
+		countfile(&dir, &dirblocks);
+		ft.ndirs++;
+		ft.dirblocks += dirblocks.blocks;
+		ft.dirextents += dirblocks.extents;
+
+		/* Now go through the entries, block by block */
+		ft.path = fd->fd_path;
+		walkfile(&dir, fragdirblock, &ft);
+
+		free(fd->fd_path);
+		free(fd);
+	}
+	free(ft.seen);
+
+	printf("    %u files, %u blocks in %u extents (", ft.nfiles,
+	       ft.totblocks, ft.totextents);
+	printratio(ft.totblocks, ft.totextents);
+	printf(" blocks/extent); %u files in more than one piece\n",
+	       ft.nfragged);
+	printf("    %u directories: %u blocks in %u extents\n", 
+	       ft.ndirs, ft.dirblocks, ft.dirextents);
+
+	/* Free space */
+	for (i=0; i<bitblocks; i++) {
+		uint32_t k;
+
+		diskread(data, SFS_MAP_LOCATION+i);
+		for (k=0; k<SFS_BLOCKBITS(blocksize); k++) {
+			uint32_t bno = i*SFS_BLOCKBITS(blocksize) + k;
+			if (bno >= fsblocks) {
+				break;
+			}
+			if (data[k/CHAR_BIT] & (1 << (k % CHAR_BIT))) {
+				run = 0;
+				continue;
+			}
+			nfree++;
+			if (run == 0) {
+				freeruns++;
+			}
+			run++;
+			if (run > maxrun) {
+				maxrun = run;
+			}
+		}
+	}
+	printf("    Free space: %u blocks in %u runs (", nfree, freeruns);
+	printratio(nfree, freeruns);
+	printf(" blocks/run), largest run %u blocks\n", maxrun);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -171,6 +516,7 @@ main(int argc, char **argv)
 	nblocks = dumpsb();
 	dumpbits(nblocks);
 	dumpdir(SFS_ROOT_LOCATION);
+	dumpfrag(nblocks);
 
 	closedisk();
 
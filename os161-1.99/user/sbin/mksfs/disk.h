@@ -30,9 +30,15 @@
 void opendisk(const char *path);
 
 uint32_t diskblocksize(void);
+void disksetblocksize(uint32_t size);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
 
+#ifdef HOST
+int diskmap(void);
+const void *diskblockptr(uint32_t block);
+#endif
+
 void closedisk(void);
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -40,6 +41,12 @@
 
 #ifdef HOST
 
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
 #include "hostcompat.h"
@@ -55,7 +62,13 @@
 
 #include "disk.h"
 
-#define MAXBITBLOCKS 32
+#define MAXBITBLOCKS 32	/* in 512-byte blocks */
+
+/* Block size of the volume being made */
+static uint32_t fsblocksize = SFS_BLOCKSIZE;
+
+/* Scratch block, for writing structures smaller than a block */
+static char blockbuf[SFS_MAXBLOCKSIZE];
 
 static
 void
@@ -66,6 +79,18 @@ check(void)
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 }
 
+/*
+ * Write LEN bytes of DATA at the start of BLOCK, and zeros after.
+ */
+static
+void
+writepadded(const void *data, size_t len, uint32_t block)
+{
+	bzero(blockbuf, fsblocksize);
+	memcpy(blockbuf, data, len);
+	diskwrite(blockbuf, block);
+}
+
 static
 void
 writesuper(const char *volname, uint32_t nblocks)
@@ -74,15 +99,12 @@ writesuper(const char *volname, uint32_t nblocks)
 
 	bzero((void *)&sp, sizeof(sp));
 
-	if (strlen(volname) >= SFS_VOLNAME_SIZE) {
-		errx(1, "Volume name %s too long", volname);
-	}
-
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_blocksize = SWAPL(fsblocksize);
 
-	diskwrite(&sp, SFS_SB_LOCATION);
+	writepadded(&sp, sizeof(sp), SFS_SB_LOCATION);
 }
 
 static
@@ -97,7 +119,7 @@ writerootdir(void)
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	writepadded(&sfi, sizeof(sfi), SFS_ROOT_LOCATION);
 }
 
 static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
@@ -115,34 +137,600 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+checkbitmapsize(uint32_t fsblocks)
 {
+	if (SFS_BITBLOCKS(fsblocks, fsblocksize) * fsblocksize >
+	    sizeof(bitbuf)) {
+		errx(1, "Filesystem too large "
+		     "- increase MAXBITBLOCKS and recompile");
+	}
+}
 
-	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+/*
+ * Write the bitmap for a volume of FSBLOCKS blocks, with the NUSED
+ * blocks after the bitmap in use.
+ */
+static
+void
+writebitmap(uint32_t fsblocks, uint32_t nused)
+{
+
+	uint32_t nbits = SFS_BITMAPSIZE(fsblocks, fsblocksize);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, fsblocksize);
 	char *ptr;
 	uint32_t i;
 
-	if (nblocks > MAXBITBLOCKS) {
-		errx(1, "Filesystem too large "
-		     "- increase MAXBITBLOCKS and recompile");
-	}
+	checkbitmapsize(fsblocks);
 
 	doallocbit(SFS_SB_LOCATION);
 	doallocbit(SFS_ROOT_LOCATION);
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<nused; i++) {
+		doallocbit(SFS_MAP_LOCATION+nblocks+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
 
 	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
+		ptr = bitbuf + i*fsblocksize;
 		diskwrite(ptr, SFS_MAP_LOCATION+i);
 	}
 }
 
+#ifdef HOST
+
+////////////////////////////////////////////////////////////
+// Populating the volume from a host directory
+//
+// The tree is scanned first, so that the space everything needs is
+// known; then every inode number and block is assigned, and the
+// whole thing is written out in one pass in increasing block order.
+// Each directory's data comes first, then for each entry its inode
+// followed by its contents, so a file's blocks are contiguous. Each
+// indirect block comes just before the blocks it points to.
+//
+// The root directory's inode is SFS_ROOT_LOCATION as usual; it's
+// written before the bitmap, and its contents start right after.
+//
+// Nothing is written until the tree is known to fit. Then the
+// superblock is cleared first and written last, so that if copying
+// fails partway the image isn't left looking like a valid volume.
+
+struct hostnode {
+	char *hn_path;			/* path on the host */
+	char hn_name[SFS_NAMELEN];	/* name in the parent directory */
+	int hn_isdir;
+	uint32_t hn_size;		/* size in bytes */
+	uint32_t hn_span;		/* blocks used, inode and subtree too */
+	uint32_t hn_ino;		/* inode number */
+	uint32_t hn_data;		/* first block of contents */
+	unsigned hn_nsubdirs;
+	struct hostnode **hn_children;
+	unsigned hn_nchildren, hn_maxchildren;
+};
+
+static unsigned long count_files, count_dirs, count_bytes;
+
+/* Data blocks held by each of the direct, indirect, double and triple
+ * indirect parts of an inode */
+#define NPARTS 4
+
+/* Blocks of data an indirect tree of depth LEVEL can hold */
+static
+uint64_t
+treecapacity(int level)
+{
+	uint64_t cap = 1;
+
+	while (level-- > 0) {
+		cap *= SFS_DBPERIDB(fsblocksize);
+	}
+	return cap;
+}
+
+/* Blocks used by an indirect tree of depth LEVEL over NDATA data blocks */
+static
+uint32_t
+treespan(int level, uint32_t ndata)
+{
+	uint32_t span = ndata;
+	int i;
+
+	for (i=1; i<=level; i++) {
+		span += (ndata + treecapacity(i) - 1) / treecapacity(i);
+	}
+	return span;
+}
+
+/*
+ * Split NDATA data blocks among the parts of an inode: COUNTS gets the
+ * number of data blocks in each. Returns the number of blocks used,
+ * data and indirect, or 0 if it doesn't fit.
+ */
+static
+uint32_t
+splitblocks(uint32_t ndata, uint32_t counts[NPARTS])
+{
+	uint32_t span;
+	uint64_t cap;
+	int i;
+
+	span = 0;
+	for (i=0; i<NPARTS; i++) {
+		cap = i == 0 ? SFS_NDIRECT : treecapacity(i);
+		counts[i] = ndata < cap ? ndata : cap;
+		ndata -= counts[i];
+		span += treespan(i, counts[i]);
+	}
+	return ndata > 0 ? 0 : span;
+}
+
+/* Blocks used by the contents of NODE, indirect blocks included */
+static
+uint32_t
+contentspan(struct hostnode *node)
+{
+	uint32_t counts[NPARTS], span;
+
+	span = splitblocks(SFS_ROUNDUP(node->hn_size, fsblocksize) /
+			   fsblocksize, counts);
+	if (span == 0 && node->hn_size > 0) {
+		errx(1, "%s: Too large for the file system", node->hn_path);
+	}
+	return span;
+}
+
+static
+struct hostnode *
+newnode(const char *path, const char *name, int isdir)
+{
+	struct hostnode *node;
+
+	node = malloc(sizeof(*node));
+	if (node == NULL) {
+		errx(1, "Out of memory");
+	}
+	node->hn_path = strdup(path);
+	if (node->hn_path == NULL) {
+		errx(1, "Out of memory");
+	}
+	assert(strlen(name) < sizeof(node->hn_name));
+	strcpy(node->hn_name, name);
+	node->hn_isdir = isdir;
+	node->hn_size = 0;
+	node->hn_span = 0;
+	node->hn_ino = 0;
+	node->hn_data = 0;
+	node->hn_nsubdirs = 0;
+	node->hn_children = NULL;
+	node->hn_nchildren = node->hn_maxchildren = 0;
+	return node;
+}
+
+static
+void
+addchild(struct hostnode *dir, struct hostnode *child)
+{
+	if (dir->hn_nchildren == dir->hn_maxchildren) {
+		dir->hn_maxchildren = (dir->hn_maxchildren+1)*2;
+		dir->hn_children = realloc(dir->hn_children,
+			dir->hn_maxchildren * sizeof(dir->hn_children[0]));
+		if (dir->hn_children == NULL) {
+			errx(1, "Out of memory");
+		}
+	}
+	dir->hn_children[dir->hn_nchildren++] = child;
+	if (child->hn_isdir) {
+		dir->hn_nsubdirs++;
+	}
+}
+
+static
+int
+childcmp(const void *a, const void *b)
+{
+	const struct hostnode *na = *(struct hostnode * const *)a;
+	const struct hostnode *nb = *(struct hostnode * const *)b;
+
+	return strcmp(na->hn_name, nb->hn_name);
+}
+
+/*
+ * Read the host directory DIR and everything under it, and work out
+ * how much space it all needs. Anything that can't go in the volume
+ * is left out with a warning.
+ */
+static
+void
+hostscan(struct hostnode *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	struct hostnode *child;
+	char *path;
+	size_t len;
+	unsigned i;
+
+	d = opendir(dir->hn_path);
+	if (d == NULL) {
+		err(1, "%s", dir->hn_path);
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+
+		len = strlen(dir->hn_path) + strlen(de->d_name) + 2;
+		path = malloc(len);
+		if (path == NULL) {
+			errx(1, "Out of memory");
+		}
+		snprintf(path, len, "%s/%s", dir->hn_path, de->d_name);
+
+		if (strlen(de->d_name) >= SFS_NAMELEN) {
+			warnx("%s: Name too long; skipped", path);
+			free(path);
+			continue;
+		}
+		if (strchr(de->d_name, ':') != NULL) {
+			warnx("%s: Name contains a colon; skipped", path);
+			free(path);
+			continue;
+		}
+		if (lstat(path, &st)) {
+			err(1, "%s", path);
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			child = newnode(path, de->d_name, 1);
+			hostscan(child);
+		}
+		else if (S_ISREG(st.st_mode)) {
+			if (st.st_size > UINT32_MAX) {
+				errx(1, "%s: Too large for the file system",
+				     path);
+			}
+			child = newnode(path, de->d_name, 0);
+			child->hn_size = st.st_size;
+			child->hn_span = 1 + contentspan(child);
+			count_files++;
+			count_bytes += st.st_size;
+		}
+		else {
+			warnx("%s: Not a file or directory; skipped", path);
+			free(path);
+			continue;
+		}
+		free(path);
+		addchild(dir, child);
+	}
+	closedir(d);
+
+	qsort(dir->hn_children, dir->hn_nchildren,
+	      sizeof(dir->hn_children[0]), childcmp);
+
+	/* . and .. and the entries */
+	dir->hn_size = (2 + dir->hn_nchildren) * sizeof(struct sfs_dir);
+	dir->hn_span = 1 + contentspan(dir);
+	for (i=0; i<dir->hn_nchildren; i++) {
+		dir->hn_span += dir->hn_children[i]->hn_span;
+	}
+	count_dirs++;
+}
+
+/*
+ * Assign inode numbers and blocks to everything under DIR, whose
+ * inode number is already set, with its contents starting at START.
+ */
+static
+void
+hostplace(struct hostnode *dir, uint32_t start)
+{
+	struct hostnode *child;
+	uint32_t pos;
+	unsigned i;
+
+	dir->hn_data = start;
+	pos = start + contentspan(dir);
+	for (i=0; i<dir->hn_nchildren; i++) {
+		child = dir->hn_children[i];
+		child->hn_ino = pos;
+		if (child->hn_isdir) {
+			hostplace(child, pos+1);
+		}
+		else {
+			child->hn_data = pos+1;
+		}
+		pos += child->hn_span;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Writing it out
+
+/* Where the contents of a file or directory come from */
+struct source {
+	int src_fd;			/* host file, or -1 */
+	const char *src_mem;		/* or the data itself */
+	uint32_t src_resid;		/* bytes left */
+	const char *src_path;		/* for messages */
+};
+
+static uint32_t lastwritten;
+
+/* Write a block; it must come after the last one */
+static
+void
+writeblock(const void *data, uint32_t block)
+{
+	assert(block > lastwritten);
+	lastwritten = block;
+	diskwrite(data, block);
+}
+
+/* Write the next block of SRC's contents, padded with zeros, at BLOCK */
+static
+void
+writenext(struct source *src, uint32_t block)
+{
+	uint32_t len, tot;
+	ssize_t r;
+
+	len = src->src_resid < fsblocksize ? src->src_resid : fsblocksize;
+	bzero(blockbuf, fsblocksize);
+	if (src->src_fd < 0) {
+		memcpy(blockbuf, src->src_mem, len);
+		src->src_mem += len;
+	}
+	else {
+		for (tot=0; tot<len; tot+=r) {
+			r = read(src->src_fd, blockbuf+tot, len-tot);
+			if (r < 0) {
+				err(1, "%s", src->src_path);
+			}
+			if (r == 0) {
+				errx(1, "%s: File shrank while being copied",
+				     src->src_path);
+			}
+		}
+	}
+	src->src_resid -= len;
+	writeblock(blockbuf, block);
+}
+
+/*
+ * Write an indirect tree of depth LEVEL over NDATA blocks of SRC,
+ * starting at START: the indirect block, then each subtree.
+ */
+static
+void
+writetree(struct source *src, int level, uint32_t ndata, uint32_t start)
+{
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t i, n, pos, per;
+
+	if (ndata == 0) {
+		return;
+	}
+	if (level == 0) {
+		for (i=0; i<ndata; i++) {
+			writenext(src, start+i);
+		}
+		return;
+	}
+
+	per = treecapacity(level-1);
+	bzero(entries, sizeof(entries));
+	pos = start + 1;
+	for (i=0; i*per < ndata; i++) {
+		n = ndata - i*per < per ? ndata - i*per : per;
+		entries[i] = SWAPL(pos);
+		pos += treespan(level-1, n);
+	}
+	writeblock(entries, start);
+
+	pos = start + 1;
+	for (i=0; i*per < ndata; i++) {
+		n = ndata - i*per < per ? ndata - i*per : per;
+		writetree(src, level-1, n, pos);
+		pos += treespan(level-1, n);
+	}
+}
+
+/* Write NODE's contents from SRC */
+static
+void
+writecontents(struct hostnode *node, struct source *src)
+{
+	uint32_t counts[NPARTS], pos;
+	int i;
+
+	splitblocks(SFS_ROUNDUP(node->hn_size, fsblocksize) / fsblocksize,
+		    counts);
+	pos = node->hn_data;
+	for (i=0; i<NPARTS; i++) {
+		writetree(src, i, counts[i], pos);
+		pos += treespan(i, counts[i]);
+	}
+	assert(src->src_resid == 0);
+}
+
+static
+void
+writeinode(struct hostnode *node)
+{
+	struct sfs_inode sfi;
+	uint32_t counts[NPARTS], pos, i;
+
+	bzero(&sfi, sizeof(sfi));
+	sfi.sfi_size = SWAPL(node->hn_size);
+	if (node->hn_isdir) {
+		sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
+		sfi.sfi_linkcount = SWAPS(2 + node->hn_nsubdirs);
+	}
+	else {
+		sfi.sfi_type = SWAPS(SFS_TYPE_FILE);
+		sfi.sfi_linkcount = SWAPS(1);
+	}
+
+	splitblocks(SFS_ROUNDUP(node->hn_size, fsblocksize) / fsblocksize,
+		    counts);
+	pos = node->hn_data;
+	for (i=0; i<counts[0]; i++) {
+		sfi.sfi_direct[i] = SWAPL(pos++);
+	}
+	if (counts[1] > 0) {
+		sfi.sfi_indirect = SWAPL(pos);
+		pos += treespan(1, counts[1]);
+	}
+	if (counts[2] > 0) {
+		sfi.sfi_dindirect = SWAPL(pos);
+		pos += treespan(2, counts[2]);
+	}
+	if (counts[3] > 0) {
+		sfi.sfi_tindirect = SWAPL(pos);
+	}
+
+	if (node->hn_ino == SFS_ROOT_LOCATION) {
+		/* written before the bitmap, out of order */
+		writepadded(&sfi, sizeof(sfi), node->hn_ino);
+	}
+	else {
+		bzero(blockbuf, fsblocksize);
+		memcpy(blockbuf, &sfi, sizeof(sfi));
+		writeblock(blockbuf, node->hn_ino);
+	}
+}
+
+static
+void
+writefile(struct hostnode *node)
+{
+	struct source src;
+
+	src.src_fd = open(node->hn_path, O_RDONLY);
+	if (src.src_fd < 0) {
+		err(1, "%s", node->hn_path);
+	}
+	src.src_mem = NULL;
+	src.src_resid = node->hn_size;
+	src.src_path = node->hn_path;
+	writecontents(node, &src);
+	close(src.src_fd);
+}
+
+/* Write the contents of directory DIR, whose parent is PARENTINO */
+static
+void
+writedir(struct hostnode *dir, uint32_t parentino)
+{
+	struct sfs_dir *entries;
+	struct source src;
+	struct hostnode *child;
+	unsigned i, n;
+
+	n = dir->hn_size / sizeof(struct sfs_dir);
+	entries = calloc(n, sizeof(struct sfs_dir));
+	if (entries == NULL) {
+		errx(1, "Out of memory");
+	}
+	entries[0].sfd_ino = SWAPL(dir->hn_ino);
+	strcpy(entries[0].sfd_name, ".");
+	entries[1].sfd_ino = SWAPL(parentino);
+	strcpy(entries[1].sfd_name, "..");
+	for (i=0; i<dir->hn_nchildren; i++) {
+		entries[i+2].sfd_ino = SWAPL(dir->hn_children[i]->hn_ino);
+		strcpy(entries[i+2].sfd_name, dir->hn_children[i]->hn_name);
+	}
+
+	src.src_fd = -1;
+	src.src_mem = (const char *)entries;
+	src.src_resid = dir->hn_size;
+	src.src_path = dir->hn_path;
+	writecontents(dir, &src);
+	free(entries);
+
+	for (i=0; i<dir->hn_nchildren; i++) {
+		child = dir->hn_children[i];
+		writeinode(child);
+		if (child->hn_isdir) {
+			writedir(child, dir->hn_ino);
+		}
+		else {
+			writefile(child);
+		}
+	}
+}
+
+static
+double
+elapsed(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_usec - from->tv_usec) / 1000000.0;
+}
+
+/*
+ * Make a volume VOLNAME of SIZE blocks holding a copy of everything
+ * under SRCDIR; then say how long it took.
+ */
+static
+void
+populate(const char *volname, const char *srcdir, uint32_t size)
+{
+	struct hostnode *root;
+	struct timeval start, scanned, done;
+	uint32_t first, nused;
+	double secs;
+
+	gettimeofday(&start, NULL);
+
+	root = newnode(srcdir, "", 1);
+	hostscan(root);
+	root->hn_ino = SFS_ROOT_LOCATION;
+	first = SFS_MAP_LOCATION + SFS_BITBLOCKS(size, fsblocksize);
+	nused = root->hn_span - 1;	/* the root inode isn't in the run */
+	if ((uint64_t)first + nused > size) {
+		errx(1, "%s needs %lu blocks; the volume only has %lu",
+		     srcdir, (unsigned long) first + nused,
+		     (unsigned long) size);
+	}
+	checkbitmapsize(size);
+	hostplace(root, first);
+
+	gettimeofday(&scanned, NULL);
+
+	/* Not necessary, but saves a pair of system calls per block */
+	(void)diskmap();
+
+	bzero(blockbuf, fsblocksize);
+	diskwrite(blockbuf, SFS_SB_LOCATION);
+
+	writeinode(root);
+	writebitmap(size, nused);
+	lastwritten = first - 1;
+	writedir(root, SFS_ROOT_LOCATION);
+	writesuper(volname, size);
+
+	gettimeofday(&done, NULL);
+
+	secs = elapsed(&scanned, &done);
+	printf("mksfs: %lu files, %lu directories, %lu KB of data; "
+	       "%lu of %lu blocks used\n", count_files, count_dirs,
+	       count_bytes / 1024, (unsigned long) first + nused,
+	       (unsigned long) size);
+	printf("mksfs: Scanned in %.3f seconds, wrote in %.3f seconds "
+	       "(%.1f MB/s)\n", elapsed(&start, &scanned), secs,
+	       secs > 0 ? (first + nused) * (double)fsblocksize /
+	       secs / 1048576 : 0);
+}
+
+#endif /* HOST */
+
 int
 main(int argc, char **argv)
 {
@@ -150,17 +738,35 @@ main(int argc, char **argv)
 	char *volname, *s;
 
 #ifdef HOST
+	const char *srcdir;
+
 	hostcompat_init(argc, argv);
-#endif
 
-	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+	if (argc!=3 && argc!=4 && argc!=5) {
+		errx(1, "Usage: mksfs device/diskfile volume-name "
+		     "[block-size [directory]]");
+	}
+	srcdir = argc==5 ? argv[4] : NULL;
+#else
+	if (argc!=3 && argc!=4) {
+		errx(1, "Usage: mksfs device/diskfile volume-name [block-size]");
 	}
+#endif
 
 	check();
 
 	volname = argv[2];
 
+	if (argc>=4) {
+		fsblocksize = atoi(argv[3]);
+		if (fsblocksize < SFS_BLOCKSIZE ||
+		    fsblocksize > SFS_MAXBLOCKSIZE ||
+		    (fsblocksize & (fsblocksize - 1)) != 0) {
+			errx(1, "Block size must be a power of 2 "
+			     "from %u to %u", SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+		}
+	}
+
 	/* Remove one trailing colon from volname, if present */
 	s = strchr(volname, ':');
 	if (s != NULL) {
@@ -176,6 +782,10 @@ main(int argc, char **argv)
 		errx(1, "Illegal volume name %s", volname);
 	}
 
+	if (strlen(volname) >= SFS_VOLNAME_SIZE) {
+		errx(1, "Volume name %s too long", volname);
+	}
+
 	opendisk(argv[1]);
 	blocksize = diskblocksize();
 
@@ -183,11 +793,20 @@ main(int argc, char **argv)
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
 		     blocksize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(fsblocksize);
 	size = diskblocks();
 
+#ifdef HOST
+	if (srcdir != NULL) {
+		populate(volname, srcdir, size);
+		closedisk();
+		return 0;
+	}
+#endif
+
 	writesuper(volname, size);
 	writerootdir();
-	writebitmap(size);
+	writebitmap(size, 0);
 
 	closedisk();
 
@@ -42,6 +42,9 @@
 #ifdef HOST
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "hostcompat.h"
 #define SWAPL(x) ntohl(x)
 #define SWAPS(x) ntohs(x)
@@ -55,6 +58,11 @@
 
 #endif
 
+/* OS/161's <stdint.h> doesn't have the limits */
+#ifndef UINT32_MAX
+#define UINT32_MAX 0xffffffffU
+#endif
+
 #include "disk.h"
 
 
@@ -66,6 +74,9 @@
 
 static int badness=0;
 
+/* Block size of the volume, and block numbers per indirect block */
+static uint32_t blocksize, dbperidb;
+
 static
 void
 setbadness(int code)
@@ -83,6 +94,7 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
 }
 
 static
@@ -139,8 +151,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<dbperidb; i++) {
 		entries[i] = SWAPL(entries[i]);
 	}
 }
@@ -169,6 +181,33 @@ domalloc(size_t len)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Read or write the first LEN bytes of BLOCK; for the superblock and
+ * inodes, which are smaller than a block if the blocks are large.
+ * Writing zeros the rest of the block.
+ */
+
+static char partbuf[SFS_MAXBLOCKSIZE];
+
+static
+void
+diskreadpart(void *data, size_t len, uint32_t block)
+{
+	diskread(partbuf, block);
+	memcpy(data, partbuf, len);
+}
+
+static
+void
+diskwritepart(const void *data, size_t len, uint32_t block)
+{
+	bzero(partbuf, sizeof(partbuf));
+	memcpy(partbuf, data, len);
+	diskwrite(partbuf, block);
+}
+
+////////////////////////////////////////////////////////////
+
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
@@ -194,7 +233,7 @@ static
 void
 bitmap_init(uint32_t bitblocks)
 {
-	size_t i, mapsize = bitblocks * SFS_BLOCKSIZE;
+	size_t i, mapsize = bitblocks * blocksize;
 	bitmapdata = domalloc(mapsize * sizeof(uint8_t));
 	tofreedata = domalloc(mapsize * sizeof(uint8_t));
 	for (i=0; i<mapsize; i++) {
@@ -270,6 +309,17 @@ bitmap_mark(uint32_t block, blockusage_t how, uint32_t howdesc)
 	}
 }
 
+/* Whether BLOCK has been marked in use (or is off the end of the map) */
+static
+int
+bitmap_isused(uint32_t block)
+{
+	if (block >= bitblocks*SFS_BLOCKBITS(blocksize)) {
+		return 1;
+	}
+	return (bitmapdata[block/8] & (((uint8_t)1)<<(block%8))) != 0;
+}
+
 static
 int
 countbits(uint8_t val)
@@ -292,7 +342,8 @@ reportbits(uint32_t bitblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = bitblock*SFS_BLOCKBITS + byte*CHAR_BIT + y;
+			blocknum = bitblock*SFS_BLOCKBITS(blocksize) +
+				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in bitmap",
 			      (unsigned long) blocknum, what);
 		}
@@ -303,18 +354,18 @@ static
 void
 check_bitmap(void)
 {
-	uint8_t bits[SFS_BLOCKSIZE], *found, *tofree, tmp;
+	uint8_t bits[SFS_MAXBLOCKSIZE], *found, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 
 	for (i=0; i<bitblocks; i++) {
 		diskread(bits, SFS_MAP_LOCATION+i);
 		swapbits(bits);
-		found = bitmapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		found = bitmapdata + i*blocksize;
+		tofree = tofreedata + i*blocksize;
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((found[j] & tofree[j])==0);
 
@@ -457,7 +508,7 @@ adjust_filelinks(void)
 			/* directory */
 			continue;
 		}
-		diskread(&sfi, inodes[i].ino);
+		diskreadpart(&sfi, sizeof(sfi), inodes[i].ino);
 		swapinode(&sfi);
 		assert(sfi.sfi_type == SFS_TYPE_FILE);
 		if (sfi.sfi_linkcount != inodes[i].linkcount) {
@@ -468,7 +519,7 @@ adjust_filelinks(void)
 			sfi.sfi_linkcount = inodes[i].linkcount;
 			setbadness(EXIT_RECOV);
 			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
+			diskwritepart(&sfi, sizeof(sfi), inodes[i].ino);
 		}
 		count_files++;
 	}
@@ -516,21 +567,31 @@ check_sb(void)
 	uint32_t i;
 	int schanged=0;
 
+	/* The superblock is one sector; read it before knowing the size */
 	diskread(&sp, SFS_SB_LOCATION);
 	swapsb(&sp);
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
 
+	blocksize = SFS_FSBLOCKSIZE(sp.sp_blocksize);
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(EXIT_UNRECOV, "Bad block size %lu",
+		     (unsigned long) blocksize);
+	}
+	disksetblocksize(blocksize);
+	dbperidb = SFS_DBPERIDB(blocksize);
+
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
-	bitblocks = SFS_BITBLOCKS(nblocks);
+	bitblocks = SFS_BITBLOCKS(nblocks, blocksize);
 	assert(nblocks>0);
 	assert(bitblocks>0);
 
 	bitmap_init(bitblocks);
-	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
+	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS(blocksize); i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
 
@@ -547,7 +608,7 @@ check_sb(void)
 
 	if (schanged) {
 		swapsb(&sp);
-		diskwrite(&sp, SFS_SB_LOCATION);
+		diskwritepart(&sp, sizeof(sp), SFS_SB_LOCATION);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
@@ -558,29 +619,124 @@ check_sb(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * The result of going through a file's block list ahead of time; see
+ * "Checking files in parallel" below. Only the host build does this;
+ * elsewhere the precheck passed around is always NULL.
+ */
+struct precheck {
+	uint32_t pc_ino;		/* the file's inode */
+	int pc_state;			/* PC_* below */
+	int pc_ok;			/* found the file and nothing wrong */
+	int pc_failed;			/* found something to complain about */
+	struct pcmark {
+		uint32_t pm_block;
+		blockusage_t pm_how;
+	} *pc_marks;			/* blocks used, in the order found */
+	unsigned pc_nmarks, pc_maxmarks;
+};
+
+#ifdef HOST
 static
 void
-check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
-		     uint32_t nblocks, uint32_t *badcountp, 
-		     int isdir, int indirection)
+precheck_addmark(struct precheck *pc, uint32_t block, blockusage_t how)
 {
-	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	if (pc->pc_nmarks == pc->pc_maxmarks) {
+		pc->pc_maxmarks = (pc->pc_maxmarks+1)*2;
+		pc->pc_marks = realloc(pc->pc_marks,
+				       pc->pc_maxmarks*sizeof(pc->pc_marks[0]));
+		if (pc->pc_marks == NULL) {
+			errx(EXIT_FATAL, "Out of memory");
+		}
+	}
+	pc->pc_marks[pc->pc_nmarks].pm_block = block;
+	pc->pc_marks[pc->pc_nmarks].pm_how = how;
+	pc->pc_nmarks++;
+}
+#endif
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
+/*
+ * Mark a block found in a file's block list, or if prechecking, write
+ * it down to mark later.
+ */
+static
+void
+markblock(struct precheck *pc, uint32_t block, blockusage_t how,
+	  uint32_t howdesc)
+{
+#ifdef HOST
+	if (pc != NULL) {
+		precheck_addmark(pc, block, how);
+		return;
 	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+#else
+	assert(pc == NULL);
+#endif
+	bitmap_mark(block, how, howdesc);
+}
+
+/*
+ * Read an indirect block. Prechecking reads straight from the mapped
+ * image, and gives up (returning -1) if the block isn't in it; the
+ * ordinary check will complain about it properly.
+ */
+static
+int
+readblock(struct precheck *pc, void *data, uint32_t block)
+{
+#ifdef HOST
+	if (pc != NULL) {
+		const void *p = diskblockptr(block);
+		if (p == NULL) {
+			pc->pc_failed = 1;
+			return -1;
 		}
+		memcpy(data, p, blocksize);
+		return 0;
 	}
+#else
+	assert(pc == NULL);
+#endif
+	diskread(data, block);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+check_indirect_block(struct precheck *pc, uint32_t ino, uint32_t *ientry,
+		     uint32_t *blockp, uint32_t nblocks, uint32_t *badcountp, 
+		     int isdir, int indirection)
+{
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t i, ct, span;
+	int level;
+
+	if (*ientry == 0) {
+		/*
+		 * Nothing to look at; just skip the file blocks it
+		 * would cover. (The triple indirect tree covers more
+		 * than fit in a uint32_t if the blocks are large.)
+		 */
+		for (level=0, span=1; level<indirection; level++) {
+			span = span > UINT32_MAX/dbperidb ?
+				UINT32_MAX : span*dbperidb;
+		}
+		*blockp = *blockp > UINT32_MAX - span ?
+			UINT32_MAX : *blockp + span;
+		return;
+	}
+
+	if (readblock(pc, entries, *ientry)) {
+		return;
+	}
+	swapindir(entries);
+	markblock(pc, *ientry, B_IBLOCK, ino);
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			check_indirect_block(ino, &entries[i], 
+		for (i=0; i<dbperidb; i++) {
+			check_indirect_block(pc, ino, &entries[i], 
 					     blockp, nblocks, 
 					     badcountp,
 					     isdir,
@@ -590,20 +746,20 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (*blockp < nblocks) {
 				if (entries[i] != 0) {
-					bitmap_mark(entries[i],
-						    isdir ? B_DIRDATA : B_DATA,
-						    ino);
+					markblock(pc, entries[i],
+						  isdir ? B_DIRDATA : B_DATA,
+						  ino);
 				}
 			}
 			else {
 				if (entries[i] != 0) {
 					(*badcountp)++;
-					bitmap_mark(entries[i],
-						    isdir ? B_DIRDATA : B_DATA,
-						    ino);
+					markblock(pc, entries[i],
+						  isdir ? B_DIRDATA : B_DATA,
+						  ino);
 					entries[i] = 0;
 				}
 			}
@@ -612,87 +768,96 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
 		if (*ientry != 0) {
 			(*badcountp)++;
-			bitmap_mark(*ientry, B_TOFREE, 0);
+			markblock(pc, *ientry, B_TOFREE, 0);
 			*ientry = 0;
 		}
 	}
 	else {
 		assert(*ientry != 0);
-		if (*badcountp > 0) {
+		/* (prechecking never fixes anything) */
+		if (*badcountp > 0 && pc == NULL) {
 			swapindir(entries);
 			diskwrite(entries, *ientry);
 		}
 	}
 }
 
-/* returns nonzero if inode modified */
+/*
+ * Returns nonzero if inode modified. If prechecking, nothing is marked
+ * or written, and it sets pc_failed instead of complaining.
+ */
 static
 int
-check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
+check_inode_blocks(struct precheck *pc, uint32_t ino, struct sfs_inode *sfi,
+		   int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
 
 	badcount = 0;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-	nblocks = size/SFS_BLOCKSIZE;
+	size = sfi->sfi_size;
+	nblocks = size/blocksize + (size % blocksize != 0);
 
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
 			if (sfi->sfi_direct[block] != 0) {
-				bitmap_mark(sfi->sfi_direct[block],
-					    isdir ? B_DIRDATA : B_DATA, ino);
+				markblock(pc, sfi->sfi_direct[block],
+					  isdir ? B_DIRDATA : B_DATA, ino);
 			}
 		}
 		else {
 			if (sfi->sfi_direct[block] != 0) {
 				badcount++;
-				bitmap_mark(sfi->sfi_direct[block],
-					    B_TOFREE, 0);
+				markblock(pc, sfi->sfi_direct[block],
+					  B_TOFREE, 0);
 			}			
 		}
 	}
 
 #ifdef SFS_NIDIRECT
 	for (i=0; i<SFS_NIDIRECT; i++) {
-		check_indirect_block(ino, &sfi->sfi_indirect[i], 
+		check_indirect_block(pc, ino, &sfi->sfi_indirect[i], 
 				     &block, nblocks, &badcount, isdir, 1);
 	}
 #else
-	check_indirect_block(ino, &sfi->sfi_indirect, 
+	check_indirect_block(pc, ino, &sfi->sfi_indirect, 
 			     &block, nblocks, &badcount, isdir, 1);
 #endif
 
 #ifdef SFS_NDIDIRECT
 	for (i=0; i<SFS_NDIDIRECT; i++) {
-		check_indirect_block(ino, &sfi->sfi_dindirect[i], 
+		check_indirect_block(pc, ino, &sfi->sfi_dindirect[i], 
 				     &block, nblocks, &badcount, isdir, 2);
 	}
 #else
 #ifdef HAS_DIDIRECT
-	check_indirect_block(ino, &sfi->sfi_dindirect, 
+	check_indirect_block(pc, ino, &sfi->sfi_dindirect, 
 			     &block, nblocks, &badcount, isdir, 2);
 #endif
 #endif
 
 #ifdef SFS_NTIDIRECT
 	for (i=0; i<SFS_NTIDIRECT; i++) {
-		check_indirect_block(ino, &sfi->sfi_tindirect[i], 
+		check_indirect_block(pc, ino, &sfi->sfi_tindirect[i], 
 				     &block, nblocks, &badcount, isdir, 3);
 	}
 #else
 #ifdef HAS_TIDIRECT
-	check_indirect_block(ino, &sfi->sfi_tindirect, 
+	check_indirect_block(pc, ino, &sfi->sfi_tindirect, 
 			     &block, nblocks, &badcount, isdir, 3);
 #endif
 #endif
 
+	if (badcount > 0 && pc != NULL) {
+		pc->pc_failed = 1;
+		return 1;
+	}
 	if (badcount > 0) {
 		warnx("Inode %lu: %lu blocks after EOF (freed)", 
 		     (unsigned long) ino, (unsigned long) badcount);
@@ -709,7 +874,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -721,10 +886,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -767,14 +932,14 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 
 #define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
+#define BMAP_IMAX   (BMAP_DMAX+dbperidb*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+dbperidb*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+dbperidb*BMAP_NIII)
 
 #define BMAP_DSIZE	1
-#define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
-#define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
-#define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
+#define BMAP_ISIZE	(BMAP_DSIZE*dbperidb)
+#define BMAP_IISIZE	(BMAP_ISIZE*dbperidb)
+#define BMAP_IIISIZE	(BMAP_IISIZE*dbperidb)
 
 static
 uint32_t
@@ -807,7 +972,7 @@ static
 void
 dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 
@@ -821,7 +986,7 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 		}
 		else {
 			warnx("Warning: sparse directory found");
-			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			bzero(d + i*atonce, blocksize);
 		}
 	}
 }
@@ -830,7 +995,7 @@ static
 void
 dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j, bad;
 
@@ -966,17 +1131,324 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Checking files in parallel (host only).
+ *
+ * Most of the work on a big volume is going through the block lists
+ * of regular files. So when check_dir gets to a directory's entries,
+ * it first hands them to a pool of threads, which go through each
+ * file's block list in the mapped image without marking or fixing
+ * anything, just writing down the blocks they find. Then check_dir
+ * goes through the entries in order as before, and for each file
+ * marks the blocks found for it, so the bitmap and the diagnostics
+ * come out exactly as they would have anyway.
+ *
+ * A precheck is only used if it found nothing wrong, and neither the
+ * inode nor any indirect block it read has been marked in use by the
+ * time it's used. Everything sfsck writes is marked in use before the
+ * next entry is looked at, so this means the precheck read what the
+ * ordinary check would have. Otherwise the file is checked again the
+ * ordinary way, which also makes any complaints in the right place.
+ * The main thread does the same with entries no thread has got to
+ * yet, rather than waiting.
+ */
+
+#ifdef HOST
+
+#define MAXTHREADS 16
+
+/* pc_state */
+#define PC_QUEUED	0	/* waiting for a thread */
+#define PC_RUNNING	1	/* a thread is on it */
+#define PC_DONE		2	/* finished */
+#define PC_TAKEN	3	/* not being prechecked */
+
+/* The entries of one directory */
+struct pcbatch {
+	struct precheck *pb_checks;	/* one per directory entry */
+	unsigned pb_n;
+	unsigned pb_nexttake;		/* next one for the threads */
+	struct pcbatch *pb_next;	/* batch of the parent directory */
+};
+
+static pthread_mutex_t pc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pc_workcv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pc_donecv = PTHREAD_COND_INITIALIZER;
+static struct pcbatch *pc_batches;	/* innermost directory first */
+static pthread_t pc_threads[MAXTHREADS];
+static unsigned pc_nthreads;
+static int pc_exiting;
+
+static unsigned long count_prechecked=0;
+
+static
+void
+precheck_file(struct precheck *pc)
+{
+	struct sfs_inode sfi;
+	const void *p;
+
+	p = diskblockptr(pc->pc_ino);
+	if (p == NULL) {
+		return;
+	}
+	memcpy(&sfi, p, sizeof(sfi));
+	swapinode(&sfi);
+	if (sfi.sfi_type != SFS_TYPE_FILE) {
+		return;
+	}
+	check_inode_blocks(pc, pc->pc_ino, &sfi, 0);
+	pc->pc_ok = !pc->pc_failed;
+}
+
+static
+void *
+precheck_thread(void *arg)
+{
+	struct pcbatch *pb;
+	struct precheck *pc;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pc_lock);
+	while (!pc_exiting) {
+		pc = NULL;
+		for (pb = pc_batches; pb != NULL && pc == NULL;
+		     pb = pb->pb_next) {
+			while (pb->pb_nexttake < pb->pb_n) {
+				pc = &pb->pb_checks[pb->pb_nexttake++];
+				if (pc->pc_state == PC_QUEUED) {
+					break;
+				}
+				pc = NULL;
+			}
+		}
+		if (pc == NULL) {
+			pthread_cond_wait(&pc_workcv, &pc_lock);
+			continue;
+		}
+
+		pc->pc_state = PC_RUNNING;
+		pthread_mutex_unlock(&pc_lock);
+		precheck_file(pc);
+		pthread_mutex_lock(&pc_lock);
+		pc->pc_state = PC_DONE;
+		pthread_cond_broadcast(&pc_donecv);
+	}
+	pthread_mutex_unlock(&pc_lock);
+	return NULL;
+}
+
+/*
+ * Start NTHREADS-1 threads to go with the main one. The image must
+ * be mapped.
+ */
+static
+void
+precheck_start(unsigned nthreads)
+{
+	unsigned i;
+	int result;
+
+	assert(nthreads <= MAXTHREADS);
+	for (i=0; i+1<nthreads; i++) {
+		result = pthread_create(&pc_threads[i], NULL,
+					precheck_thread, NULL);
+		if (result) {
+			errx(EXIT_FATAL, "pthread_create: %s",
+			     strerror(result));
+		}
+		pc_nthreads++;
+	}
+}
+
+static
+void
+precheck_stop(void)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&pc_lock);
+	assert(pc_batches == NULL);
+	pc_exiting = 1;
+	pthread_cond_broadcast(&pc_workcv);
+	pthread_mutex_unlock(&pc_lock);
+
+	for (i=0; i<pc_nthreads; i++) {
+		pthread_join(pc_threads[i], NULL);
+	}
+	pc_nthreads = 0;
+}
+
+/*
+ * Hand the entries of a directory to the threads. Returns NULL if
+ * there aren't any threads.
+ */
+static
+struct pcbatch *
+precheck_batch(const struct sfs_dir *d, unsigned nd)
+{
+	struct pcbatch *pb;
+	struct precheck *pc;
+	unsigned i;
+
+	if (pc_nthreads == 0 || nd == 0) {
+		return NULL;
+	}
+
+	pb = domalloc(sizeof(*pb));
+	pb->pb_checks = domalloc(nd * sizeof(struct precheck));
+	pb->pb_n = nd;
+	pb->pb_nexttake = 0;
+	for (i=0; i<nd; i++) {
+		pc = &pb->pb_checks[i];
+		pc->pc_ino = d[i].sfd_ino;
+		if (d[i].sfd_ino == SFS_NOINO ||
+		    !strcmp(d[i].sfd_name, ".") ||
+		    !strcmp(d[i].sfd_name, "..")) {
+			pc->pc_state = PC_TAKEN;
+		}
+		else {
+			pc->pc_state = PC_QUEUED;
+		}
+		pc->pc_ok = 0;
+		pc->pc_failed = 0;
+		pc->pc_marks = NULL;
+		pc->pc_nmarks = pc->pc_maxmarks = 0;
+	}
+
+	pthread_mutex_lock(&pc_lock);
+	pb->pb_next = pc_batches;
+	pc_batches = pb;
+	pthread_cond_broadcast(&pc_workcv);
+	pthread_mutex_unlock(&pc_lock);
+
+	return pb;
+}
+
+/*
+ * Use the precheck of entry INDEX, which names inode INO, if there is
+ * a good one: mark the blocks it found. Returns nonzero if it did;
+ * otherwise the entry needs to be checked the ordinary way.
+ */
+static
+int
+precheck_use(struct pcbatch *pb, unsigned index, uint32_t ino)
+{
+	struct precheck *pc;
+	unsigned i;
+
+	if (pb == NULL) {
+		return 0;
+	}
+	assert(index < pb->pb_n);
+	pc = &pb->pb_checks[index];
+
+	pthread_mutex_lock(&pc_lock);
+	if (pc->pc_state == PC_QUEUED) {
+		/* no thread has got to it; quicker to do it ourselves */
+		pc->pc_state = PC_TAKEN;
+	}
+	while (pc->pc_state == PC_RUNNING) {
+		pthread_cond_wait(&pc_donecv, &pc_lock);
+	}
+	pthread_mutex_unlock(&pc_lock);
+
+	if (pc->pc_state != PC_DONE || !pc->pc_ok || pc->pc_ino != ino) {
+		return 0;
+	}
+	if (bitmap_isused(pc->pc_ino)) {
+		return 0;
+	}
+	for (i=0; i<pc->pc_nmarks; i++) {
+		if (pc->pc_marks[i].pm_how == B_IBLOCK &&
+		    bitmap_isused(pc->pc_marks[i].pm_block)) {
+			return 0;
+		}
+	}
+
+	for (i=0; i<pc->pc_nmarks; i++) {
+		bitmap_mark(pc->pc_marks[i].pm_block, pc->pc_marks[i].pm_how,
+			    pc->pc_ino);
+	}
+	count_prechecked++;
+	return 1;
+}
+
+static
+void
+precheck_endbatch(struct pcbatch *pb)
+{
+	unsigned i;
+
+	if (pb == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pc_lock);
+	assert(pc_batches == pb);
+	pc_batches = pb->pb_next;
+	for (i=0; i<pb->pb_n; i++) {
+		if (pb->pb_checks[i].pc_state == PC_QUEUED) {
+			pb->pb_checks[i].pc_state = PC_TAKEN;
+		}
+		while (pb->pb_checks[i].pc_state == PC_RUNNING) {
+			pthread_cond_wait(&pc_donecv, &pc_lock);
+		}
+	}
+	pthread_mutex_unlock(&pc_lock);
+
+	for (i=0; i<pb->pb_n; i++) {
+		free(pb->pb_checks[i].pc_marks);
+	}
+	free(pb->pb_checks);
+	free(pb);
+}
+
+#else /* not HOST */
+
+static
+struct pcbatch *
+precheck_batch(const struct sfs_dir *d, unsigned nd)
+{
+	(void)d;
+	(void)nd;
+	return NULL;
+}
+
+static
+int
+precheck_use(struct pcbatch *pb, unsigned index, uint32_t ino)
+{
+	(void)pb;
+	(void)index;
+	(void)ino;
+	return 0;
+}
+
+static
+void
+precheck_endbatch(struct pcbatch *pb)
+{
+	(void)pb;
+}
+
+#endif /* HOST */
+
+////////////////////////////////////////////////////////////
+
 static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 {
 	struct sfs_inode sfi;
 	struct sfs_dir *direntries;
+	struct pcbatch *pb;
 	int *sortvector;
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
-	diskread(&sfi, ino);
+	diskreadpart(&sfi, sizeof(sfi), ino);
 	swapinode(&sfi);
 
 	if (remember_dir(ino, pathsofar)) {
@@ -996,13 +1468,13 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
-	if (check_inode_blocks(ino, &sfi, 1)) {
+	if (check_inode_blocks(NULL, ino, &sfi, 1)) {
 		ichanged = 1;
 	}
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+				    blocksize/sizeof(struct sfs_dir));
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1127,6 +1599,8 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 	}
 
+	pb = precheck_batch(direntries, ndirentries);
+
 	subdircount=0;
 	for (i=0; i<ndirentries; i++) {
 		if (!strcmp(direntries[i].sfd_name, ".")) {
@@ -1142,18 +1616,27 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
+			if (precheck_use(pb, i, direntries[i].sfd_ino)) {
+				/* a file with nothing wrong with it */
+				observe_filelink(direntries[i].sfd_ino);
+				continue;
+			}
+
+			diskreadpart(&subsfi, sizeof(subsfi),
+				     direntries[i].sfd_ino);
 			swapinode(&subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
 
 			switch (subsfi.sfi_type) {
 			    case SFS_TYPE_FILE:
-				if (check_inode_blocks(direntries[i].sfd_ino,
+				if (check_inode_blocks(NULL,
+						       direntries[i].sfd_ino,
 						       &subsfi, 0)) {
 					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
+					diskwritepart(&subsfi,
+						      sizeof(subsfi),
+						      direntries[i].sfd_ino);
 				}
 				observe_filelink(direntries[i].sfd_ino);
 				break;
@@ -1185,6 +1668,8 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 	}
 
+	precheck_endbatch(pb);
+
 	if (sfi.sfi_linkcount != subdircount+2) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory /%s: Link count %lu should be %lu (fixed)",
@@ -1200,7 +1685,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (ichanged) {
 		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		diskwritepart(&sfi, sizeof(sfi), ino);
 	}
 
 	free(direntries);
@@ -1215,7 +1700,7 @@ void
 check_root_dir(void)
 {
 	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
+	diskreadpart(&sfi, sizeof(sfi), SFS_ROOT_LOCATION);
 	swapinode(&sfi);
 
 	switch (sfi.sfi_type) {
@@ -1231,7 +1716,7 @@ check_root_dir(void)
 		setbadness(EXIT_RECOV);
 		sfi.sfi_type = SFS_TYPE_DIR;
 		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		diskwritepart(&sfi, sizeof(sfi), SFS_ROOT_LOCATION);
 		break;
 	}
 
@@ -1244,12 +1729,36 @@ int
 main(int argc, char **argv)
 {
 #ifdef HOST
+	struct timeval starttime, endtime;
+	double secs;
+	long nthreads;
+
 	hostcompat_init(argc, argv);
-#endif
 
+	if (argc!=2 && argc!=3) {
+		errx(EXIT_USAGE, "Usage: sfsck device/diskfile [threads]");
+	}
+	if (argc==3) {
+		nthreads = atoi(argv[2]);
+		if (nthreads < 1 || nthreads > MAXTHREADS) {
+			errx(EXIT_USAGE, "Threads must be between 1 and %d",
+			     MAXTHREADS);
+		}
+	}
+	else {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads < 1) {
+			nthreads = 1;
+		}
+		if (nthreads > MAXTHREADS) {
+			nthreads = MAXTHREADS;
+		}
+	}
+#else
 	if (argc!=2) {
 		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
 	}
+#endif
 
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
@@ -1257,8 +1766,22 @@ main(int argc, char **argv)
 
 	opendisk(argv[1]);
 
+#ifdef HOST
+	gettimeofday(&starttime, NULL);
+	if (diskmap()) {
+		/* the threads need the image mapped */
+		nthreads = 1;
+	}
+#endif
+
 	check_sb();
+#ifdef HOST
+	precheck_start(nthreads);
+#endif
 	check_root_dir();
+#ifdef HOST
+	precheck_stop();
+#endif
 	check_bitmap();
 	adjust_filelinks();
 
@@ -1267,6 +1790,17 @@ main(int argc, char **argv)
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
 	      count_blocks, (unsigned long) nblocks, count_dirs, count_files);
 
+#ifdef HOST
+	gettimeofday(&endtime, NULL);
+	secs = (endtime.tv_sec - starttime.tv_sec) +
+		(endtime.tv_usec - starttime.tv_usec) / 1000000.0;
+	warnx("Checked %lu KB in %.3f seconds (%.1f MB/s); %ld threads, "
+	      "%lu files prechecked",
+	      (unsigned long) (count_blocks * (blocksize / 1024.0)), secs,
+	      secs > 0 ? count_blocks * (double) blocksize / secs / 1048576 : 0,
+	      nthreads, count_prechecked);
+#endif
+
 	switch (badness) {
 	    case EXIT_USAGE:
 	    case EXIT_FATAL: